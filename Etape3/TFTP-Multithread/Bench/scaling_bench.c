@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define SIZE 516
+#define MAX_CLIENTS 64
+#define MAX_TIMEOUTS 5
+
+/* Runs 1, 2, 4... concurrent RRQs of the same file against the multithreaded
+   server and reports the aggregate throughput for each level. The file must
+   exist in the server's directory. */
+
+typedef struct {
+    const char *fileName;
+    struct sockaddr_in server;
+    long long bytes;
+    int failed;
+} BenchClient;
+
+void dieWithError(char *errorMessage) {
+    perror(errorMessage);
+    exit(EXIT_FAILURE);
+}
+
+double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* One plain RRQ: every block is acknowledged to whichever address sent it, a
+   timeout acknowledges the last block again. */
+void *runClient(void *args) {
+    BenchClient *client = args;
+    char buffer[SIZE];
+    char ackPacket[4] = {0, 4, 0, 0};
+    struct sockaddr_in addr = client->server;
+    socklen_t addr_size = sizeof(addr);
+    int expectedBlock = 1, timeouts = 0, gotBlock = 0;
+    
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+        dieWithError("[ERROR] socket error");
+    
+    struct timeval tv = { 1, 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    
+    memset(buffer, 0, SIZE);
+    buffer[1] = 1;
+    strcpy(buffer + 2, client->fileName);
+    strcpy(buffer + 2 + strlen(client->fileName) + 1, "octet");
+    int packetLength = 2 + strlen(client->fileName) + 1 + strlen("octet") + 1;
+    if (sendto(sockfd, buffer, packetLength, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        dieWithError("[ERROR] sending RRQ");
+    
+    while (1) {
+        addr_size = sizeof(addr);
+        int n = recvfrom(sockfd, buffer, SIZE, 0, (struct sockaddr *)&addr, &addr_size);
+        
+        if (n < 0) {
+            if ((errno != EAGAIN && errno != EWOULDBLOCK) || ++timeouts > MAX_TIMEOUTS) {
+                client->failed = 1;
+                break;
+            }
+            if (gotBlock)
+                sendto(sockfd, ackPacket, sizeof(ackPacket), 0, (struct sockaddr *)&addr, sizeof(addr));
+            continue;
+        }
+        
+        if (n < 4 || buffer[1] != 3) {
+            client->failed = buffer[1] == 5;
+            if (client->failed)
+                break;
+            continue;
+        }
+        
+        int blockNumber = (unsigned char)buffer[2] << 8 | (unsigned char)buffer[3];
+        if (blockNumber == expectedBlock) {
+            client->bytes += n - 4;
+            expectedBlock = (expectedBlock + 1) & 0xFFFF;
+            ackPacket[2] = buffer[2];
+            ackPacket[3] = buffer[3];
+            gotBlock = 1;
+            timeouts = 0;
+        }
+        sendto(sockfd, ackPacket, sizeof(ackPacket), 0, (struct sockaddr *)&addr, sizeof(addr));
+        
+        if (blockNumber == ((expectedBlock - 1) & 0xFFFF) && n < SIZE)
+            break;
+    }
+    
+    close(sockfd);
+    return NULL;
+}
+
+void benchmark(const char *fileName, struct sockaddr_in server, int count) {
+    pthread_t threads[MAX_CLIENTS];
+    BenchClient clients[MAX_CLIENTS];
+    long long bytes = 0;
+    int failed = 0;
+    
+    double start = nowNs();
+    for (int i = 0; i < count; i++) {
+        clients[i].fileName = fileName;
+        clients[i].server = server;
+        clients[i].bytes = 0;
+        clients[i].failed = 0;
+        if (pthread_create(&threads[i], NULL, runClient, &clients[i]) != 0)
+            dieWithError("[ERROR] Failed to create thread");
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+        bytes += clients[i].bytes;
+        failed += clients[i].failed;
+    }
+    double seconds = (nowNs() - start) / 1e9;
+    
+    printf("%4d clients | %8.2f MB/s | %6.2f transfers/s | %d failed\n",
+           count, bytes / seconds / 1e6, (count - failed) / seconds, failed);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s file [max_clients]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    
+    int maxClients = argc > 2 ? atoi(argv[2]) : 16;
+    if (maxClients < 1 || maxClients > MAX_CLIENTS)
+        maxClients = MAX_CLIENTS;
+    
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(8080);
+    server.sin_addr.s_addr = inet_addr("127.0.0.1");
+    
+    printf("[INFO] Concurrent RRQ of %s, 1 to %d clients\n", argv[1], maxClients);
+    for (int count = 1; count <= maxClients; count *= 2)
+        benchmark(argv[1], server, count);
+    return 0;
+}
@@ -5,27 +5,126 @@
 #include <arpa/inet.h>
 #include <sys/select.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #define SIZE 516
 #define TIMEOUT 5
 #define MAX_RETRIES 5
-#define MAX_CLIENT 15
+#define DEFAULT_QUEUE_CAPACITY 256
+#define PATH_LOCK_STRIPES 256
+#define DEQUE_CAPACITY 1024
+#define SESSION_SLICE_BLOCKS 64
+#define IDLE_WAIT_MS 10
+#define REQUEST_INTERVAL 4
+#define WAIT_EVENTS 64
 
-pthread_t threads[MAX_CLIENT];
-int num_clients = 0;
-pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define SLICE_DONE 0
+#define SLICE_MORE 1
+#define SLICE_BLOCKED 2
+#define SLICE_WAIT 3
 
 
 
 typedef struct {
-    int sockfd;
     struct sockaddr_in addr;
     char data[SIZE];
     int len;
 } ClientArgs;
 
 
+/* Bounded multi-producer multi-consumer queue of accepted requests, held by
+   value so accepting a request never allocates. Its eventfd is readable while
+   the queue is not empty; it sits in every worker's epoll set, so an idle
+   worker sleeps on its clients and on new requests at once. A full queue
+   refuses the request instead of stalling the receiving thread. */
+typedef struct {
+    ClientArgs *slots;
+    int capacity;
+    int head;
+    int count;
+    pthread_mutex_t mutex;
+    int eventFd;
+} RequestQueue;
+
+RequestQueue request_queue;
+
+/* Files are locked by path through a fixed table of reader-writer locks: any
+   number of RRQs share a file, a WRQ has it to itself. Two paths hashing to
+   the same stripe only ever wait for each other's writers. A session can be
+   released by another worker than the one that locked it, which rules out
+   pthread_rwlock_t. Sessions that find the stripe taken wait in its list. */
+typedef struct {
+    pthread_mutex_t mutex;
+    int readers;
+    int writer;
+    struct Session *waiting;
+} PathLock;
+
+PathLock path_locks[PATH_LOCK_STRIPES];
+
+
+/* A transfer in progress. Sessions are run a slice at a time by whichever
+   worker holds them; pathLock stays NULL until the file is opened. */
+typedef struct Session {
+    struct sockaddr_in addr;
+    int sockfd;
+    FILE *fp;
+    PathLock *pathLock;
+    int isRead;
+    int blockNumber;    /* RRQ: last block sent, WRQ: next block expected */
+    int retries;
+    int length;         /* RRQ: data bytes of the block in flight */
+    int awaitingAck;
+    long long deadlineMs;
+    char filename[SIZE];
+    char buffer[SIZE];
+    struct Worker *owner;
+    struct Session *nextFree;
+    struct Session *nextWaiting;
+    struct Worker *watcher;     /* whose epoll set has the socket, or NULL */
+    struct Session *prevIdle;
+    struct Session *nextIdle;
+} Session;
+
+typedef struct {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(Session *) *slots;
+} WorkDeque;
+
+/* Finished sessions go back to the worker that allocated them, so the heap is
+   only hit while the server warms up. A session stolen and finished by another
+   worker is pushed onto remoteFree, which the owner takes whole once its own
+   list runs dry.
+
+   Sessions waiting for their client are on no deque: they are in the idle
+   list of the worker that last ran them, their socket in its epoll set, until
+   a packet arrives or their deadline passes. Only that worker touches its idle
+   list. */
+typedef struct Worker {
+    WorkDeque deque;
+    unsigned int seed;
+    int index;
+    Session *freeSessions;
+    _Atomic(Session *) remoteFree;
+    _Atomic unsigned long sessionAllocs;
+    int slicesSinceRequest;
+    int epollFd;
+    Session *idleSessions;
+    long long nextDeadlineScan;
+} Worker;
+
+Worker *workers;
+int worker_count;
+volatile sig_atomic_t stop_requested = 0;
+
+
 void dieWithError(char *errorMessage, int sockfd) {
     if (sockfd >= 0) close(sockfd);
     perror(errorMessage);
@@ -49,184 +148,722 @@ void sendErrorPacket(int sockfd, struct sockaddr_in *addr, int errorCode, const
 
 
 
-int receiveACK(int sockfd, int expectedBlockNumber, struct sockaddr_in *addr){
-    char ackBuffer[4];
-    socklen_t addr_size = sizeof(struct sockaddr_in);
+void initRequestQueue(RequestQueue *queue, int capacity) {
+    queue->slots = calloc(capacity, sizeof(ClientArgs));
+    if (queue->slots == NULL)
+        dieWithError("[ERROR] malloc error", -1);
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    queue->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->eventFd < 0)
+        dieWithError("[ERROR] eventfd error", -1);
+}
+
+
+
+void initPathLocks(void) {
+    for (int i = 0; i < PATH_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&path_locks[i].mutex, NULL);
+        path_locks[i].readers = 0;
+        path_locks[i].writer = 0;
+        path_locks[i].waiting = NULL;
+    }
+}
+
+
+
+/* Never blocks: a worker waiting here could be the one that has to run the
+   session holding the lock. On NULL the session has been parked on the lock
+   and belongs to whoever releases it; the caller must not touch it again. */
+PathLock *tryLockPath(struct Session *session, int exclusive) {
+    const char *path = session->filename;
+    uint32_t h = 2166136261u;
+    while (*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    
+    PathLock *lock = &path_locks[h % PATH_LOCK_STRIPES];
+    pthread_mutex_lock(&lock->mutex);
+    if (lock->writer || (exclusive && lock->readers > 0)) {
+        session->nextWaiting = lock->waiting;
+        lock->waiting = session;
+        pthread_mutex_unlock(&lock->mutex);
+        return NULL;
+    }
+    if (exclusive)
+        lock->writer = 1;
+    else
+        lock->readers++;
+    pthread_mutex_unlock(&lock->mutex);
+    return lock;
+}
+
+
+
+/* Returns the sessions parked on the lock once nobody holds it any more. */
+struct Session *unlockPath(PathLock *lock) {
+    struct Session *waiting = NULL;
+    
+    pthread_mutex_lock(&lock->mutex);
+    if (lock->writer)
+        lock->writer = 0;
+    else
+        lock->readers--;
+    if (!lock->writer && lock->readers == 0) {
+        waiting = lock->waiting;
+        lock->waiting = NULL;
+    }
+    pthread_mutex_unlock(&lock->mutex);
+    return waiting;
+}
+
+
+
+int pushRequest(RequestQueue *queue, const ClientArgs *request) {
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->count == queue->capacity) {
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+    queue->slots[(queue->head + queue->count) % queue->capacity] = *request;
+    if (queue->count++ == 0) {
+        uint64_t one = 1;
+        if (write(queue->eventFd, &one, sizeof(one)) < 0)
+            perror("[ERROR] eventfd write error");
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return 0;
+}
+
+
+
+/* Never blocks, returns -1 if the queue is empty. */
+int popRequest(RequestQueue *queue, ClientArgs *request) {
+    uint64_t value;
+    
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+    *request = queue->slots[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    if (--queue->count == 0 && read(queue->eventFd, &value, sizeof(value)) < 0)
+        perror("[ERROR] eventfd read error");
+    pthread_mutex_unlock(&queue->mutex);
+    return 0;
+}
+
+
+
+/* Chase-Lev deque (with the C11 orderings of Le et al.). Only the owner
+   pushes and pops at the bottom; thieves take from the top. */
+void initDeque(WorkDeque *deque) {
+    deque->slots = calloc(DEQUE_CAPACITY, sizeof(*deque->slots));
+    if (deque->slots == NULL)
+        dieWithError("[ERROR] malloc error", -1);
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+}
+
+
+
+int dequePush(WorkDeque *deque, Session *session) {
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (b - t >= DEQUE_CAPACITY)
+        return -1;
+    atomic_store_explicit(&deque->slots[b & (DEQUE_CAPACITY - 1)], session, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+
+
+Session *dequePop(WorkDeque *deque) {
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    Session *session = NULL;
     
+    if (t <= b) {
+        session = atomic_load_explicit(&deque->slots[b & (DEQUE_CAPACITY - 1)], memory_order_relaxed);
+        if (t == b) {
+            /* Last element: race the thieves for it. */
+            if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+                session = NULL;
+            atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return session;
+}
+
+
+
+Session *dequeSteal(WorkDeque *deque) {
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
     
-    int n = recvfrom(sockfd, ackBuffer, sizeof(ackBuffer), 0, (struct sockaddr *)addr, &addr_size);
+    Session *session = atomic_load_explicit(&deque->slots[t & (DEQUE_CAPACITY - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return session;
+}
+
+
+
+/* Visits every other worker once, starting from a random victim. */
+Session *stealSession(Worker *self) {
+    if (worker_count < 2)
+        return NULL;
     
-    if (n < 0)
-        printf("[ERROR] receiving ACK");
+    int start = rand_r(&self->seed) % worker_count;
+    for (int i = 0; i < worker_count; i++) {
+        Worker *victim = &workers[(start + i) % worker_count];
+        if (victim == self)
+            continue;
+        Session *session = dequeSteal(&victim->deque);
+        if (session != NULL)
+            return session;
+    }
+    return NULL;
+}
+
+
+
+/* Each transfer gets its own socket: a fresh ephemeral port (the server's TID)
+   connected to the client, so the kernel hands this worker only the packets of
+   its transfer and the main loop only sees new requests. It never blocks: a
+   session waiting for its client goes to the worker's epoll set. */
+int openTransferSocket(struct sockaddr_in *addr) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0)
+        return -1;
     
+    if (connect(sockfd, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+
+
+long long monotonicMs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+
+
+/* recv() on the session's socket. Fails with EAGAIN when nothing came yet,
+   ETIMEDOUT once the session's deadline has passed. */
+int receivePacket(Session *session, char *buffer, int size) {
+    int n = recv(session->sockfd, buffer, size, 0);
+    if (n >= 0 || errno != EAGAIN)
+        return n;
     
-    if (ackBuffer[1] != 4)
-        printf("[ERROR] Not an ACK packet");
+    errno = session->deadlineMs > monotonicMs() ? EAGAIN : ETIMEDOUT;
+    return -1;
+}
+
+
+
+/* Returns 0 once the ACK of the block in flight arrives, 1 while it has not,
+   -1 on timeout and -2 if the client aborted. ACKs of earlier blocks are
+   duplicates and skipped. */
+int receiveACK(Session *session) {
+    char ackBuffer[SIZE];
+    int expectedBlockNumber = session->blockNumber & 0xFFFF;
     
+    while (1) {
+        int n = receivePacket(session, ackBuffer, sizeof(ackBuffer) - 1);
+        
+        if (n < 0 && errno == EAGAIN)
+            return 1;
+        if (n < 0) {
+            printf("[ERROR] Timeout occurred while waiting for ACK.\n");
+            return -1;
+        }
+        
+        
+        if (n >= 4 && ackBuffer[1] == 5) {
+            ackBuffer[n] = 0;
+            printf("[ERROR] Client aborted the transfer: %s\n", ackBuffer + 4);
+            return -2;
+        }
+        
+        if (n < 4 || ackBuffer[1] != 4) {
+            printf("[ERROR] Not an ACK packet\n");
+            continue;
+        }
+        
+        
+        int blockNumber = (unsigned char)ackBuffer[2] << 8 | (unsigned char)ackBuffer[3];
+        
+        
+        if (blockNumber != expectedBlockNumber) {
+            printf("[ERROR] Unexpected block number in ACK\n");
+            continue;
+        }
+        
+        printf("[INFO] Received ACK for block %d\n", blockNumber);
+        return 0;
+    }
+}
+
+
+
+void releaseSession(Worker *self, Session *session) {
+    Worker *owner = session->owner;
     
-    int blockNumber = (unsigned char)ackBuffer[2] << 8 | (unsigned char)ackBuffer[3];
+    if (owner == self) {
+        session->nextFree = self->freeSessions;
+        self->freeSessions = session;
+        return;
+    }
+    Session *head = atomic_load_explicit(&owner->remoteFree, memory_order_relaxed);
+    do {
+        session->nextFree = head;
+    } while (!atomic_compare_exchange_weak_explicit(&owner->remoteFree, &head, session, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+
+
+Session *startSession(Worker *self, ClientArgs *clientArgs) {
+    if (self->freeSessions == NULL)
+        self->freeSessions = atomic_exchange_explicit(&self->remoteFree, NULL, memory_order_acquire);
     
+    Session *session = self->freeSessions;
+    if (session != NULL) {
+        self->freeSessions = session->nextFree;
+    } else {
+        session = malloc(sizeof(Session));
+        if (session == NULL)
+            return NULL;
+        session->owner = self;
+        atomic_fetch_add_explicit(&self->sessionAllocs, 1, memory_order_relaxed);
+    }
     
-    if (blockNumber != expectedBlockNumber)
-        printf("[ERROR] Unexpected block number in ACK");
+    /* The packet buffers are overwritten before use, no need to clear them. */
+    session->addr = clientArgs->addr;
+    session->fp = NULL;
+    session->pathLock = NULL;
+    session->isRead = clientArgs->data[1] == 1;
+    session->blockNumber = 0;
+    session->retries = 0;
+    session->awaitingAck = 0;
+    session->watcher = NULL;
+    int nameLength = strnlen(clientArgs->data + 2, clientArgs->len > 2 ? clientArgs->len - 2 : 0);
+    memcpy(session->filename, clientArgs->data + 2, nameLength);
+    session->filename[nameLength] = '\0';
     
-    printf("[INFO] Received ACK for block %d\n", blockNumber);
-    return 0;
+    session->sockfd = openTransferSocket(&session->addr);
+    if (session->sockfd < 0) {
+        perror("[ERROR] transfer socket error");
+        releaseSession(self, session);
+        return NULL;
+    }
+    return session;
 }
 
-void* handleRequest(void* args) {
-    pthread_mutex_lock(&file_mutex);
-    ClientArgs* clientArgs = (ClientArgs*)args;
+
+
+void scheduleSession(Worker *self, Session *session);
+
+/* Sessions parked on the file's lock are retried by this worker. */
+void finishSession(Worker *self, Session *session) {
+    Session *waiting = NULL;
     
-    int sockfd = clientArgs->sockfd;
-    struct sockaddr_in addr = clientArgs->addr;
-    int len = clientArgs->len;
+    if (session->fp != NULL) fclose(session->fp);
+    if (session->pathLock != NULL) waiting = unlockPath(session->pathLock);
+    close(session->sockfd);
+    releaseSession(self, session);
     
-    char buffer[SIZE];
-    FILE *fp = NULL;
-    socklen_t addr_size = sizeof(struct sockaddr_in);
-    int n, readBytes, blockNumber, retries, ackReceived, running = 1;
+    while (waiting != NULL) {
+        Session *next = waiting->nextWaiting;
+        scheduleSession(self, waiting);
+        waiting = next;
+    }
+}
+
+
+
+/* Takes the path lock and opens the file. Returns SLICE_BLOCKED when the
+   session had to be parked on the lock. */
+int openSession(Session *session) {
     char ackPacket[4] = {0, 4, 0, 0};
-    char *filename;
     
-    memcpy(buffer, clientArgs->data, len);
-    free(args);
+    session->pathLock = tryLockPath(session, !session->isRead);
+    if (session->pathLock == NULL)
+        return SLICE_BLOCKED;
+    
+    if (session->isRead) {
+        session->fp = fopen(session->filename, "r");
+        if (session->fp == NULL) {
+            perror("[ERROR] Cannot open file");
+            sendErrorPacket(session->sockfd, &session->addr, 1, "File not found");
+            return SLICE_DONE;
+        }
+        session->blockNumber = 0;
+        return SLICE_MORE;
+    }
     
-    while (running) {
+    if (access(session->filename, F_OK) != -1) {
+        perror("[ERROR] File already exists");
+        sendErrorPacket(session->sockfd, &session->addr, 6, "File already exists");
+        return SLICE_DONE;
+    }
+    
+    session->fp = fopen(session->filename, "wb");
+    if (session->fp == NULL) {
+        sendErrorPacket(session->sockfd, &session->addr, 2, "Cannot create file.");
+        return SLICE_DONE;
+    }
+    
+    session->blockNumber = 1;
+    if (send(session->sockfd, ackPacket, sizeof(ackPacket), 0) < 0) {
+        printf("[ERROR] sendto error\n");
+        return SLICE_DONE;
+    }
+    session->deadlineMs = monotonicMs() + TIMEOUT * 1000;
+    return SLICE_MORE;
+}
+
+
+
+void sendBlock(Session *session) {
+    if (send(session->sockfd, session->buffer, session->length + 4, 0) < 0)
+        printf("[ERROR] sending block to the client.\n");
+    session->deadlineMs = monotonicMs() + TIMEOUT * 1000;
+}
+
+
+
+/* The last block is the first one shorter than 512 bytes, empty if the file
+   size is a multiple of 512. A block whose ACK has not come yet stays in the
+   session's buffer until the next slice. */
+int sendSlice(Session *session) {
+    char *buffer = session->buffer;
+    
+    for (int i = 0; i < SESSION_SLICE_BLOCKS; i++) {
+        if (!session->awaitingAck) {
+            memset(buffer, 0, SIZE);
+            session->length = fread(buffer + 4, 1, 512, session->fp);
+            session->blockNumber++;
+            printf("[SENDING] Block %d\n", session->blockNumber);
+            buffer[1] = 3;
+            buffer[2] = (session->blockNumber >> 8) & 0xFF;
+            buffer[3] = session->blockNumber & 0xFF;
+            session->retries = 0;
+            session->awaitingAck = 1;
+            sendBlock(session);
+        }
         
+        int result = receiveACK(session);
+        if (result == 1)
+            return SLICE_WAIT;
+        if (result == -1 && ++session->retries < MAX_RETRIES) {
+            printf("[RETRY] Resending block %d\n", session->blockNumber);
+            sendBlock(session);
+            continue;
+        }
         
-        if (buffer[1] == 2){
-            char *filename = buffer + 2;
-            
-            if (access(filename, F_OK) != -1) {
-                perror("[ERROR] File already exists");
-                
-                buffer[1] = 5;
-                buffer[3] = 6;
-                strcpy(buffer + 4, "File already exists");
-                
-                if (sendto(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&addr, addr_size) < 0)
-                    printf("[ERROR] sendto error");
-                
-                continue;
-            }
-            
-            
-            fp = fopen(filename, "wb");
-            if (fp == NULL) {
-                
-                sendErrorPacket(sockfd, &addr, 2, "Cannot create file.");
-                running = 0;
-                break;
-            }
-            
-            
-            if (sendto(sockfd, ackPacket, sizeof(ackPacket), 0, (struct sockaddr *)&addr, addr_size) < 0) {
-                printf("[ERROR] sendto error\n");
-                running = 0;
+        if (result != 0) {
+            printf("[ERROR] Transfer aborted.\n");
+            return SLICE_DONE;
+        }
+        session->awaitingAck = 0;
+        
+        if (session->length < 512) {
+            printf("[SUCCESS] File sent successfully.\n");
+            return SLICE_DONE;
+        }
+    }
+    return SLICE_MORE;
+}
+
+
+
+int receiveSlice(Session *session) {
+    char *buffer = session->buffer;
+    char ackPacket[4] = {0, 4, 0, 0};
+    
+    for (int i = 0; i < SESSION_SLICE_BLOCKS; i++) {
+        int n = receivePacket(session, buffer, SIZE);
+        int lastBlock = (session->blockNumber - 1) & 0xFFFF;
+        
+        if (n < 0 && errno == EAGAIN)
+            return SLICE_WAIT;
+        if (n < 0) {
+            if (++session->retries > MAX_RETRIES) {
+                printf("[ERROR] recvfrom error\n");
+                return SLICE_DONE;
             }
-            break;
+            printf("[RETRY] Timeout, acknowledging again...\n");
+            ackPacket[2] = (lastBlock >> 8) & 0xFF;
+            ackPacket[3] = lastBlock & 0xFF;
+            send(session->sockfd, ackPacket, sizeof(ackPacket), 0);
+            session->deadlineMs = monotonicMs() + TIMEOUT * 1000;
+            continue;
         }
         
-        else if (buffer[1] == 3){
-            
-            if (fwrite(buffer + 4, 1, n - 4, fp) < 1){
+        if (n >= 2 && buffer[1] == 5) {
+            printf("[ERROR] Client aborted the transfer.\n");
+            return SLICE_DONE;
+        }
+        if (n < 4 || buffer[1] != 3)
+            continue;
+        
+        
+        int blockNumber = (unsigned char)buffer[2] << 8 | (unsigned char)buffer[3];
+        
+        /* A block we already wrote means our ACK was lost: ACK it again. */
+        if (blockNumber == session->blockNumber) {
+            if (n > 4 && fwrite(buffer + 4, 1, n - 4, session->fp) < (size_t)(n - 4)){
                 printf("[ERROR] fwrite error\n");
-                running = 0;
-                break;
+                return SLICE_DONE;
             }
-            
-            
-            ackPacket[2] = buffer[2];
-            ackPacket[3] = buffer[3];
-            
-            
-            if (sendto(sockfd, ackPacket, sizeof(ackPacket), 0, (struct sockaddr *)&addr, addr_size) < 0) {
-                printf("[ERROR] sendto error\n");
-                running = 0;
-                break;
-            }
-            
-            
-            if (n < 512){
-                printf("[SUCCESS] File received successfully.\n");
-                fclose(fp);
-                running = 0;
-                break;
-            }
-            break;
+            session->blockNumber = (session->blockNumber + 1) & 0xFFFF;
+            session->retries = 0;
         }
         
-        else if (buffer[1] == 1){
-            int readBytes, blockNumber = 0;
-            char *filename = buffer + 2;
-            
-            
-            fp = fopen(filename, "r");
-            if (fp == NULL){
-                perror("[ERROR] Cannot open file");
-                
-                buffer[1] = 5;
-                buffer[3] = 1;
-                strcpy(buffer + 4, "File not found");
-                
-                if (sendto(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&addr, addr_size) < 0)
-                    printf("[ERROR] sendto error");
-                
-                running = 0;
-                break;
-            }
-            
-            
-            memset(buffer, 0, SIZE);
-            
-            
-            while ((readBytes = fread(buffer + 4, 1, 512, fp)) > 0){
-                blockNumber++;
-                printf("[SENDING] Block %d\n", blockNumber);
-                buffer[1] = 3;
-                
-                
-                buffer[2] = (blockNumber >> 8) & 0xFF;
-                buffer[3] = blockNumber & 0xFF;
-                
-                
-                n = sendto(sockfd, buffer, readBytes + 4, 0, (struct sockaddr *)&addr, sizeof(addr));
-                
-                if (n < 0)
-                    printf("[ERROR] sending block to the server.");
-                
-                
-                receiveACK(sockfd, blockNumber, &addr);
-                
-                memset(buffer, 0, SIZE);
-            }
-            
-            printf("[SUCCESS] File sent successfully.\n");
-            fclose(fp);
-            running = 0;
-            break;
+        
+        ackPacket[2] = buffer[2];
+        ackPacket[3] = buffer[3];
+        if (send(session->sockfd, ackPacket, sizeof(ackPacket), 0) < 0) {
+            printf("[ERROR] sendto error\n");
+            return SLICE_DONE;
         }
-        if (running) {
-            memset(buffer, 0, SIZE);
-            addr_size = sizeof(addr);
-            n = recvfrom(sockfd, buffer, SIZE, 0, (struct sockaddr *)&addr, &addr_size);
-            if (n < 0) {
-                printf("[ERROR] recvfrom error\n");
-                running = 0;
-            }
+        session->deadlineMs = monotonicMs() + TIMEOUT * 1000;
+        
+        
+        if (blockNumber == ((session->blockNumber - 1) & 0xFFFF) && n < SIZE){
+            printf("[SUCCESS] File received successfully.\n");
+            return SLICE_DONE;
         }
     }
+    return SLICE_MORE;
+}
+
+
+
+/* Runs at most SESSION_SLICE_BLOCKS blocks of a transfer, so a multi-GB file
+   goes back to a deque regularly where an idle worker can pick it up. Stops
+   early with SLICE_WAIT when the client has not answered yet. */
+int runSessionSlice(Worker *self, Session *session) {
+    int state;
     
-    if (fp != NULL) fclose(fp);
-    pthread_mutex_unlock(&file_mutex);
-    pthread_exit(NULL);
+    if (session->pathLock == NULL)
+        state = openSession(session);
+    else if (session->isRead)
+        state = sendSlice(session);
+    else
+        state = receiveSlice(session);
+    
+    if (state == SLICE_DONE)
+        finishSession(self, session);
+    return state;
+}
+
+
+
+void waitForClient(Worker *self, Session *session);
+
+/* Deque full: the session is run here until it ends, waits or gets parked,
+   rather than dropped. */
+void scheduleSession(Worker *self, Session *session) {
+    int state;
+    
+    if (dequePush(&self->deque, session) == 0)
+        return;
+    do {
+        state = runSessionSlice(self, session);
+    } while (state == SLICE_MORE);
+    if (state == SLICE_WAIT)
+        waitForClient(self, session);
+}
+
+
+
+void unlinkIdle(Worker *self, Session *session) {
+    if (session->prevIdle != NULL)
+        session->prevIdle->nextIdle = session->nextIdle;
+    else
+        self->idleSessions = session->nextIdle;
+    if (session->nextIdle != NULL)
+        session->nextIdle->prevIdle = session->prevIdle;
+}
+
+
+
+/* The socket is armed one-shot, so a session is handed back at most once per
+   wait. A session stolen since its last wait is moved from the other worker's
+   set, where it can no longer fire. */
+void waitForClient(Worker *self, Session *session) {
+    struct epoll_event event = { EPOLLIN | EPOLLONESHOT, { .ptr = session } };
+    int r;
+    
+    if (session->watcher == self) {
+        r = epoll_ctl(self->epollFd, EPOLL_CTL_MOD, session->sockfd, &event);
+    } else {
+        if (session->watcher != NULL)
+            epoll_ctl(session->watcher->epollFd, EPOLL_CTL_DEL, session->sockfd, NULL);
+        r = epoll_ctl(self->epollFd, EPOLL_CTL_ADD, session->sockfd, &event);
+    }
+    if (r < 0) {
+        /* Outside the set, the session is retried from the deque. */
+        perror("[ERROR] epoll_ctl error");
+        epoll_ctl(self->epollFd, EPOLL_CTL_DEL, session->sockfd, NULL);
+        session->watcher = NULL;
+        if (dequePush(&self->deque, session) < 0) {
+            sendErrorPacket(session->sockfd, &session->addr, 0, "Server busy");
+            finishSession(self, session);
+        }
+        return;
+    }
+    
+    session->watcher = self;
+    session->prevIdle = NULL;
+    session->nextIdle = self->idleSessions;
+    if (self->idleSessions != NULL)
+        self->idleSessions->prevIdle = session;
+    self->idleSessions = session;
 }
 
-int main() {
+
+
+/* Moves the sessions whose client answered, and every IDLE_WAIT_MS those
+   whose deadline passed, onto the deque. Waits at most timeoutMs for one. */
+void collectIdleSessions(Worker *self, int timeoutMs) {
+    struct epoll_event events[WAIT_EVENTS];
+    
+    int n = epoll_wait(self->epollFd, events, WAIT_EVENTS, timeoutMs);
+    for (int i = 0; i < n; i++) {
+        Session *session = events[i].data.ptr;
+        if (session == NULL)
+            continue;
+        unlinkIdle(self, session);
+        scheduleSession(self, session);
+    }
+    
+    long long now = monotonicMs();
+    if (now < self->nextDeadlineScan)
+        return;
+    self->nextDeadlineScan = now + IDLE_WAIT_MS;
+    
+    Session *session = self->idleSessions;
+    while (session != NULL) {
+        Session *next = session->nextIdle;
+        if (session->deadlineMs <= now) {
+            epoll_ctl(self->epollFd, EPOLL_CTL_DEL, session->sockfd, NULL);
+            session->watcher = NULL;
+            unlinkIdle(self, session);
+            scheduleSession(self, session);
+        }
+        session = next;
+    }
+}
+
+
+
+void finishSlice(Worker *self, Session *session, int state) {
+    if (state == SLICE_MORE)
+        scheduleSession(self, session);
+    else if (state == SLICE_WAIT)
+        waitForClient(self, session);
+}
+
+
+
+/* A worker takes a new request, and the sessions whose client answered, every
+   REQUEST_INTERVAL slices of its own sessions and whenever its deque is empty:
+   a short transfer starts without waiting for the long ones, and a burst of
+   requests cannot starve them. Then it steals. With nothing to do, it sleeps
+   in its epoll set until a client answers or a request comes. */
+void* workerLoop(void* args) {
+    Worker *self = args;
+    
+    while (1) {
+        Session *session = NULL;
+        ClientArgs request;
+        
+        if (self->slicesSinceRequest < REQUEST_INTERVAL)
+            session = dequePop(&self->deque);
+        if (session == NULL) {
+            self->slicesSinceRequest = 0;
+            collectIdleSessions(self, 0);
+            if (popRequest(&request_queue, &request) == 0)
+                session = startSession(self, &request);
+        } else {
+            self->slicesSinceRequest++;
+        }
+        if (session == NULL)
+            session = dequePop(&self->deque);
+        if (session == NULL)
+            session = stealSession(self);
+        if (session == NULL) {
+            collectIdleSessions(self, IDLE_WAIT_MS);
+            continue;
+        }
+        
+        /* A blocked session is parked on its file's lock, no longer ours. */
+        finishSlice(self, session, runSessionSlice(self, session));
+    }
+    
+    return NULL;
+}
+
+void onStopSignal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+
+
+void printWorkerStats(void) {
+    unsigned long allocs = 0;
+    for (int i = 0; i < worker_count; i++)
+        allocs += atomic_load_explicit(&workers[i].sessionAllocs, memory_order_relaxed);
+    printf("[STATS] %lu sessions allocated by %d workers\n", allocs, worker_count);
+}
+
+int main(int argc, char *argv[]) {
     
     char *ip = "127.0.0.1";
     int port = 8080;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int queueCapacity = DEFAULT_QUEUE_CAPACITY;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "t:q:")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'q':
+                queueCapacity = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t workers] [-q queue_capacity]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (threads < 1)
+        threads = 1;
+    if (queueCapacity < 1)
+        queueCapacity = 1;
     
     
     int server_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -246,45 +883,76 @@ int main() {
     
     if (r < 0) dieWithError("[ERROR] Bind error", server_sockfd);
     
-    char buffer[SIZE];
+    ClientArgs request;
     socklen_t addr_len = sizeof(client_addr);
     
-    printf("[STARTING] UDP File Server started on %s:%d.\n", ip, port);
+    initRequestQueue(&request_queue, queueCapacity);
+    initPathLocks();
+    
+    worker_count = threads;
+    workers = calloc(worker_count, sizeof(Worker));
+    if (workers == NULL)
+        dieWithError("[ERROR] malloc error", server_sockfd);
+    for (int i = 0; i < worker_count; i++) {
+        initDeque(&workers[i].deque);
+        workers[i].seed = i + 1;
+        workers[i].index = i;
+        atomic_init(&workers[i].remoteFree, NULL);
+        atomic_init(&workers[i].sessionAllocs, 0);
+        
+        struct epoll_event event = { EPOLLIN, { .ptr = NULL } };
+        workers[i].epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (workers[i].epollFd < 0 || epoll_ctl(workers[i].epollFd, EPOLL_CTL_ADD, request_queue.eventFd, &event) < 0)
+            dieWithError("[ERROR] epoll error", server_sockfd);
+    }
+    
+    /* SIGINT/SIGTERM interrupt the recvfrom() of the main thread only: the
+       workers are started with them blocked. */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onStopSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
     
-    while(1) {
-        sleep(1);
+    for (int i = 0; i < worker_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, workerLoop, &workers[i]) != 0)
+            dieWithError("[ERROR] Failed to create thread", server_sockfd);
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &stopSignals, NULL);
+    
+    printf("[STARTING] UDP File Server started on %s:%d with %d workers.\n", ip, port, worker_count);
+    
+    while (!stop_requested) {
         printf("[INFO] Waiting for requests...\n");
         
-        r = recvfrom(server_sockfd, buffer, SIZE, 0, (struct sockaddr *)&client_addr, &addr_len);
+        addr_len = sizeof(client_addr);
+        r = recvfrom(server_sockfd, request.data, SIZE, 0, (struct sockaddr *)&client_addr, &addr_len);
         if (r < 0) continue;
         
-        if (buffer[1] == 1 || buffer[1] == 2) {
-            
-            ClientArgs* clientArgs = (ClientArgs*)malloc(sizeof(ClientArgs));
-            if (!clientArgs) continue;
+        if (request.data[1] == 1 || request.data[1] == 2) {
             
-            clientArgs->sockfd = server_sockfd;
-            clientArgs->addr = client_addr;
-            memcpy(clientArgs->data, buffer, r);
-            clientArgs->len = r;
+            request.addr = client_addr;
+            request.len = r;
             
             
-            pthread_mutex_lock(&client_mutex);
-            if (num_clients < MAX_CLIENT) {
-                if (pthread_create(&threads[num_clients++], NULL, handleRequest, (void*)clientArgs) != 0) {
-                    perror("[ERROR] Failed to create thread");
-                    free(clientArgs);
-                }
-            } else {
-                printf("[INFO] Maximum number of clients reached. Dropping request.\n");
-                free(clientArgs);
+            if (pushRequest(&request_queue, &request) < 0) {
+                printf("[INFO] Request queue full. Dropping request.\n");
+                sendErrorPacket(server_sockfd, &client_addr, 0, "Server busy");
             }
-            pthread_mutex_unlock(&client_mutex);
         }
         
     }
     
     printf("[CLOSING] Closing the server.\n");
+    printWorkerStats();
     
     close(server_sockfd);
     
@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+
+#include "../Commun/rto.h"
+#include "../Commun/packet.h"
+#include "../Serveur/session.h"
+
+/* UDP relay that impairs the traffic between TFTP clients and a server: loss,
+   duplication, reordering, delay and jitter, in both directions. Clients talk
+   to the relay's port; each client address gets its own upstream socket, so
+   the server sees one peer per client and its TIDs keep working. Replies are
+   all sent back from the relay's port, where the client takes them for the
+   server's TID.
+
+   The fate of a packet only depends on the seed, the flow (numbered in order
+   of appearance), the direction and the packet's rank in that direction, not
+   on timing or on the other flows: the same packets meet the same fate, and
+   two runs only drift apart where the endpoints' own timers fire differently.
+
+   The clients always use port 8080; to put the relay in their way:
+       server -p 8081 &
+       loss_relay -l 8080 -s 127.0.0.1:8081 -L 1 &
+       client get file bigfile
+   A goodput sweep with tftp-bench, against the relay on its default port:
+       for loss in 0.1 1 5; do
+           loss_relay -L $loss & tftp_bench -p 9090 -f file -c 8 -d 10; kill $!
+       done */
+#define MAX_PACKET 65536
+#define EPOLL_BATCH 256
+#define FLOW_IDLE_US 30000000LL
+
+enum { TO_SERVER, TO_CLIENT };
+
+struct Session {
+    struct sockaddr_in client;
+    struct sockaddr_in server;
+    int upstream;
+    unsigned long ordinal;
+    unsigned long packets[2];
+    int queued;
+    long long lastActive;
+    struct Session *next;
+};
+
+typedef struct {
+    long long release;
+    unsigned long sequence;
+    Session *flow;
+    int direction;
+    int len;
+    char *data;
+} QueuedPacket;
+
+typedef struct {
+    double loss;
+    double duplicate;
+    double reorder;
+    long long delayUs;
+    long long jitterUs;
+    long long reorderUs;
+} Impairments;
+
+typedef struct {
+    unsigned long received[2];
+    unsigned long dropped[2];
+    unsigned long duplicated[2];
+    unsigned long reordered[2];
+    unsigned long sent[2];
+} RelayStats;
+
+Impairments impairments;
+unsigned long long seed = 1;
+struct sockaddr_in server_addr;
+int listen_fd;
+int epfd;
+SessionTable flows;
+Session *flow_list = NULL;
+unsigned long flow_count = 0;
+QueuedPacket *queue;
+int queue_count = 0;
+int queue_capacity = 0;
+unsigned long queue_sequence = 0;
+RelayStats stats;
+volatile sig_atomic_t stop_requested = 0;
+
+void dieWithError(char *errorMessage) {
+    perror(errorMessage);
+    exit(EXIT_FAILURE);
+}
+
+/* SplitMix64 finaliser: a counter-based generator, so any (flow, direction,
+   rank, draw) tuple gets its own number without shared state. */
+unsigned long long mix64(unsigned long long x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/* Uniform in [0, 1) for the draw-th decision about a packet. */
+double packetRandom(Session *flow, int direction, unsigned long rank, int draw) {
+    unsigned long long x = mix64(seed ^ mix64(flow->ordinal * 2 + direction));
+    x = mix64(x ^ mix64(rank * 8 + draw));
+    return (x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int earlier(QueuedPacket *a, QueuedPacket *b) {
+    return a->release < b->release || (a->release == b->release && a->sequence < b->sequence);
+}
+
+void queuePush(QueuedPacket packet) {
+    if (queue_count == queue_capacity) {
+        queue_capacity = queue_capacity ? queue_capacity * 2 : 1024;
+        queue = realloc(queue, queue_capacity * sizeof(QueuedPacket));
+        if (queue == NULL)
+            dieWithError("[ERROR] malloc error");
+    }
+    int i = queue_count++;
+    while (i > 0 && earlier(&packet, &queue[(i - 1) / 2])) {
+        queue[i] = queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue[i] = packet;
+}
+
+QueuedPacket queuePop(void) {
+    QueuedPacket top = queue[0];
+    QueuedPacket last = queue[--queue_count];
+    int i = 0;
+
+    while (2 * i + 1 < queue_count) {
+        int child = 2 * i + 1;
+        if (child + 1 < queue_count && earlier(&queue[child + 1], &queue[child]))
+            child++;
+        if (!earlier(&queue[child], &last))
+            break;
+        queue[i] = queue[child];
+        i = child;
+    }
+    if (queue_count > 0)
+        queue[i] = last;
+    return top;
+}
+
+void deliver(Session *flow, int direction, const char *data, int len) {
+    int n;
+    if (direction == TO_SERVER)
+        n = sendto(flow->upstream, data, len, 0, (struct sockaddr *)&flow->server, sizeof(flow->server));
+    else
+        n = sendto(listen_fd, data, len, 0, (struct sockaddr *)&flow->client, sizeof(flow->client));
+    if (n == len)
+        stats.sent[direction]++;
+}
+
+void schedule(Session *flow, int direction, const char *data, int len, long long delay) {
+    QueuedPacket packet;
+    packet.release = monotonicUs() + delay;
+    packet.sequence = queue_sequence++;
+    packet.flow = flow;
+    packet.direction = direction;
+    packet.len = len;
+    packet.data = malloc(len);
+    if (packet.data == NULL)
+        dieWithError("[ERROR] malloc error");
+    memcpy(packet.data, data, len);
+    flow->queued++;
+    queuePush(packet);
+}
+
+/* Decides the fate of one packet: dropped, or sent once or twice after the
+   base delay plus jitter. A reordered copy is held back reorderUs longer, so
+   the packets behind it overtake it. */
+void impair(Session *flow, int direction, const char *data, int len) {
+    unsigned long rank = flow->packets[direction]++;
+    stats.received[direction]++;
+
+    if (packetRandom(flow, direction, rank, 0) < impairments.loss) {
+        stats.dropped[direction]++;
+        return;
+    }
+
+    int copies = packetRandom(flow, direction, rank, 1) < impairments.duplicate ? 2 : 1;
+    if (copies == 2)
+        stats.duplicated[direction]++;
+    for (int copy = 0; copy < copies; copy++) {
+        long long delay = impairments.delayUs;
+        if (impairments.jitterUs > 0)
+            delay += (long long)((packetRandom(flow, direction, rank, 2 + copy) * 2 - 1) * impairments.jitterUs);
+        if (packetRandom(flow, direction, rank, 4 + copy) < impairments.reorder) {
+            delay += impairments.reorderUs;
+            stats.reordered[direction]++;
+        }
+        if (delay <= 0 && queue_count == 0)
+            deliver(flow, direction, data, len);
+        else
+            schedule(flow, direction, data, len, delay > 0 ? delay : 0);
+    }
+}
+
+Session *findFlow(struct sockaddr_in client) {
+    Session *flow = sessionLookup(&flows, client);
+    if (flow != NULL)
+        return flow;
+
+    flow = calloc(1, sizeof(Session));
+    if (flow == NULL)
+        dieWithError("[ERROR] malloc error");
+    flow->client = client;
+    flow->server = server_addr;
+    flow->ordinal = flow_count++;
+    flow->upstream = socket(AF_INET, SOCK_DGRAM, 0);
+    if (flow->upstream < 0)
+        dieWithError("[ERROR] socket error");
+    fcntl(flow->upstream, F_SETFL, fcntl(flow->upstream, F_GETFL, 0) | O_NONBLOCK);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = flow;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, flow->upstream, &event) < 0)
+        dieWithError("[ERROR] epoll_ctl error");
+    if (sessionInsert(&flows, client, flow) < 0)
+        dieWithError("[ERROR] flow table error");
+    flow->next = flow_list;
+    flow_list = flow;
+    return flow;
+}
+
+/* Flows are dropped after FLOW_IDLE_US of silence, once nothing is queued for them. */
+void expireFlows(long long now) {
+    Session **link = &flow_list;
+
+    while (*link != NULL) {
+        Session *flow = *link;
+        if (flow->queued == 0 && now - flow->lastActive > FLOW_IDLE_US) {
+            *link = flow->next;
+            sessionRemove(&flows, flow->client);
+            close(flow->upstream);
+            free(flow);
+        } else {
+            link = &flow->next;
+        }
+    }
+}
+
+char packet[MAX_PACKET];
+
+void onClientReadable(void) {
+    struct sockaddr_in from;
+    socklen_t fromLen;
+
+    while (1) {
+        fromLen = sizeof(from);
+        int n = recvfrom(listen_fd, packet, sizeof(packet), 0, (struct sockaddr *)&from, &fromLen);
+        if (n < 0)
+            return;
+        Session *flow = findFlow(from);
+        flow->lastActive = monotonicUs();
+
+        /* A new request starts a new transfer, even from a reused client port. */
+        int opcode = packetOpcode(packet, n);
+        if (opcode == OP_RRQ || opcode == OP_WRQ)
+            flow->server = server_addr;
+        impair(flow, TO_SERVER, packet, n);
+    }
+}
+
+/* The server answers from the transfer's TID: later client packets go there. */
+void onServerReadable(Session *flow) {
+    struct sockaddr_in from;
+    socklen_t fromLen;
+
+    while (1) {
+        fromLen = sizeof(from);
+        int n = recvfrom(flow->upstream, packet, sizeof(packet), 0, (struct sockaddr *)&from, &fromLen);
+        if (n < 0)
+            return;
+        flow->server = from;
+        flow->lastActive = monotonicUs();
+        impair(flow, TO_CLIENT, packet, n);
+    }
+}
+
+void releaseDue(long long now) {
+    while (queue_count > 0 && queue[0].release <= now) {
+        QueuedPacket due = queuePop();
+        deliver(due.flow, due.direction, due.data, due.len);
+        due.flow->queued--;
+        free(due.data);
+    }
+}
+
+void onSignal(int signum) {
+    (void)signum;
+    stop_requested = 1;
+}
+
+void printStats(void) {
+    const char *names[2] = { "client -> server", "server -> client" };
+    for (int d = 0; d < 2; d++)
+        printf("[STATS] %s: %lu received, %lu dropped, %lu duplicated, %lu reordered, %lu sent\n", names[d],
+               stats.received[d], stats.dropped[d], stats.duplicated[d], stats.reordered[d], stats.sent[d]);
+    printf("[STATS] %lu flows\n", flow_count);
+}
+
+int main(int argc, char *argv[]) {
+    int listenPort = 9090;
+    char serverIp[64] = "127.0.0.1";
+    int serverPort = 8080;
+    double reorderMs = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:s:L:D:R:d:j:g:S:")) != -1) {
+        switch (opt) {
+            case 'l':
+                listenPort = atoi(optarg);
+                break;
+            case 's':
+                if (sscanf(optarg, "%63[^:]:%d", serverIp, &serverPort) < 1)
+                    dieWithError("[ERROR] Server must be ip[:port]");
+                break;
+            case 'L':
+                impairments.loss = atof(optarg) / 100;
+                break;
+            case 'D':
+                impairments.duplicate = atof(optarg) / 100;
+                break;
+            case 'R':
+                impairments.reorder = atof(optarg) / 100;
+                break;
+            case 'd':
+                impairments.delayUs = (long long)(atof(optarg) * 1000);
+                break;
+            case 'j':
+                impairments.jitterUs = (long long)(atof(optarg) * 1000);
+                break;
+            case 'g':
+                reorderMs = atof(optarg);
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-l listen_port] [-s server_ip[:port]] [-L loss_%%] [-D duplicate_%%] [-R reorder_%%]\n"
+                                "          [-d delay_ms] [-j jitter_ms] [-g reorder_gap_ms] [-S seed]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    /* By default a reordered packet is held back long enough for a few others to pass it. */
+    impairments.reorderUs = reorderMs >= 0 ? (long long)(reorderMs * 1000) : impairments.delayUs + impairments.jitterUs + 2000;
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(serverPort);
+    server_addr.sin_addr.s_addr = inet_addr(serverIp);
+
+    struct sockaddr_in listenAddr;
+    memset(&listenAddr, 0, sizeof(listenAddr));
+    listenAddr.sin_family = AF_INET;
+    listenAddr.sin_port = htons(listenPort);
+    listenAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    listen_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (listen_fd < 0)
+        dieWithError("[ERROR] socket error");
+    if (bind(listen_fd, (struct sockaddr *)&listenAddr, sizeof(listenAddr)) < 0)
+        dieWithError("[ERROR] bind error");
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+
+    epfd = epoll_create1(0);
+    if (epfd < 0)
+        dieWithError("[ERROR] epoll_create1 error");
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &event) < 0)
+        dieWithError("[ERROR] epoll_ctl error");
+    if (sessionTableInit(&flows) < 0)
+        dieWithError("[ERROR] flow table error");
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    printf("[STARTING] Relay 127.0.0.1:%d -> %s:%d, loss %.2f%%, duplicate %.2f%%, reorder %.2f%%, delay %.1f ms, jitter %.1f ms, seed %llu\n",
+           listenPort, serverIp, serverPort, impairments.loss * 100, impairments.duplicate * 100,
+           impairments.reorder * 100, impairments.delayUs / 1000.0, impairments.jitterUs / 1000.0, seed);
+    fflush(stdout);
+
+    struct epoll_event events[EPOLL_BATCH];
+    long long lastExpiry = monotonicUs();
+
+    while (!stop_requested) {
+        int timeoutMs = 100;
+        if (queue_count > 0) {
+            long long wait = queue[0].release - monotonicUs();
+            timeoutMs = wait <= 0 ? 0 : (int)((wait + 999) / 1000);
+            if (timeoutMs > 100)
+                timeoutMs = 100;
+        }
+
+        int n = epoll_wait(epfd, events, EPOLL_BATCH, timeoutMs);
+        if (n < 0 && errno != EINTR)
+            dieWithError("[ERROR] epoll_wait error");
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                onClientReadable();
+            else
+                onServerReadable(events[i].data.ptr);
+        }
+
+        long long now = monotonicUs();
+        releaseDue(now);
+        if (now - lastExpiry > 1000000) {
+            expireFlows(now);
+            lastExpiry = now;
+        }
+    }
+
+    printStats();
+    sessionTableDestroy(&flows);
+    close(epfd);
+    close(listen_fd);
+    return 0;
+}
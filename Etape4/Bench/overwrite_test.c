@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "../Commun/packet.h"
+
+/* overwrite-test: uploads a file to a running server, starts reading it back,
+   overwrites it with a WRQ while the read is halfway through, then finishes
+   the read. The read must return the old contents in full and a new read the
+   new ones: an upload must not change a file under the transfers reading it.
+
+   Plain RFC 1350 transfers (512-byte blocks, one in flight), so the files stay
+   under 65535 blocks. Exits with a failure status on the first bad trial.
+
+   gcc -O2 overwrite_test.c -o overwrite_test && ./overwrite_test -p 8080 -n 16 */
+#define BLOCK 512
+#define SIZE (4 + BLOCK)
+#define RETRIES 5
+
+struct sockaddr_in server_addr;
+char *file_name = "overwrite-test.bin";
+
+void dieWithError(char *errorMessage) {
+    perror(errorMessage);
+    exit(EXIT_FAILURE);
+}
+
+int openSocket(void) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+        dieWithError("[ERROR] socket error");
+    struct timeval timeout = { 1, 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sockfd;
+}
+
+void fillRandom(char *data, size_t length) {
+    for (size_t i = 0; i < length; i++)
+        data[i] = (char)rand();
+}
+
+/* Waits for a packet from the server, ignoring strays. Returns its length, or
+   -1 on timeout or on an ERROR packet. */
+int receiveFrom(int sockfd, char *packet, struct sockaddr_in *peer) {
+    while (1) {
+        socklen_t len = sizeof(*peer);
+        int n = recvfrom(sockfd, packet, SIZE, 0, (struct sockaddr *)peer, &len);
+        if (n < 0)
+            return -1;
+        if (peer->sin_addr.s_addr != server_addr.sin_addr.s_addr || n < 4)
+            continue;
+        if (packetOpcode(packet, n) == OP_ERROR) {
+            fprintf(stderr, "[ERROR] Server error: %.*s\n", n - 4, packet + 4);
+            return -1;
+        }
+        return n;
+    }
+}
+
+int sendRequest(int sockfd, int opcode) {
+    char packet[SIZE];
+    int len = packRequest(packet, SIZE, opcode, file_name);
+    return sendto(sockfd, packet, len, 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
+}
+
+void packHeader(char *packet, int opcode, long long block) {
+    packOpcode(packet, SIZE, opcode);
+    packet[2] = (char)(block >> 8);
+    packet[3] = (char)block;
+}
+
+int packetBlock(const char *packet) {
+    return (unsigned char)packet[2] << 8 | (unsigned char)packet[3];
+}
+
+/* Lockstep WRQ of the whole buffer: the request, then each block, is sent
+   until its ACK comes back. */
+int putFile(const char *data, size_t length) {
+    int sockfd = openSocket();
+    char packet[SIZE], reply[SIZE];
+    struct sockaddr_in peer = server_addr;
+    long long blocks = length / BLOCK + 1;
+    int len = packRequest(packet, SIZE, OP_WRQ, file_name);
+
+    for (long long block = 0; block <= blocks; block++) {
+        int tries = 0;
+        while (1) {
+            if (tries++ >= RETRIES) {
+                close(sockfd);
+                return -1;
+            }
+            sendto(sockfd, packet, len, 0, (struct sockaddr *)&peer, sizeof(peer));
+            int n = receiveFrom(sockfd, reply, &peer);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                close(sockfd);
+                return -1;
+            }
+            if (n >= 4 && packetOpcode(reply, n) == OP_ACK && packetBlock(reply) == (block & 0xFFFF))
+                break;
+        }
+        if (block == blocks)
+            break;
+
+        size_t offset = block * BLOCK;
+        size_t chunk = length - offset < BLOCK ? length - offset : BLOCK;
+        packHeader(packet, OP_DATA, block + 1);
+        memcpy(packet + 4, data + offset, chunk);
+        len = 4 + chunk;
+    }
+    close(sockfd);
+    return 0;
+}
+
+/* A RRQ read in steps: readBlocks() receives up to count more blocks. */
+typedef struct {
+    int sockfd;
+    struct sockaddr_in peer;
+    long long block;
+    char *data;
+    size_t length;
+    size_t capacity;
+    int done;
+} Reader;
+
+void startRead(Reader *reader, size_t capacity) {
+    memset(reader, 0, sizeof(*reader));
+    reader->sockfd = openSocket();
+    reader->data = malloc(capacity);
+    reader->capacity = capacity;
+    if (reader->data == NULL)
+        dieWithError("[ERROR] malloc error");
+    sendRequest(reader->sockfd, OP_RRQ);
+}
+
+int readBlocks(Reader *reader, long long count) {
+    char packet[SIZE], ack[4];
+
+    while (!reader->done && count-- > 0) {
+        int tries = 0, n;
+        while (1) {
+            n = receiveFrom(reader->sockfd, packet, &reader->peer);
+            if (n >= 4 && packetOpcode(packet, n) == OP_DATA && packetBlock(packet) == ((reader->block + 1) & 0xFFFF))
+                break;
+            if (n < 0 || ++tries >= RETRIES)
+                return -1;
+        }
+        size_t chunk = n - 4;
+        if (reader->length + chunk > reader->capacity)
+            return -1;
+        memcpy(reader->data + reader->length, packet + 4, chunk);
+        reader->length += chunk;
+        reader->block++;
+        packHeader(ack, OP_ACK, reader->block);
+        sendto(reader->sockfd, ack, 4, 0, (struct sockaddr *)&reader->peer, sizeof(reader->peer));
+        if (chunk < BLOCK)
+            reader->done = 1;
+    }
+    return 0;
+}
+
+void endRead(Reader *reader) {
+    close(reader->sockfd);
+    free(reader->data);
+}
+
+int runTrial(int trial, size_t oldSize, size_t newSize) {
+    char *oldData = malloc(oldSize), *newData = malloc(newSize);
+    if (oldData == NULL || newData == NULL)
+        dieWithError("[ERROR] malloc error");
+    fillRandom(oldData, oldSize);
+    fillRandom(newData, newSize);
+    int ok = 0;
+
+    Reader reader, check;
+    if (putFile(oldData, oldSize) < 0) {
+        fprintf(stderr, "[ERROR] Trial %d: first upload failed\n", trial);
+        goto out;
+    }
+    startRead(&reader, oldSize + newSize);
+    if (readBlocks(&reader, oldSize / BLOCK / 2) < 0) {
+        fprintf(stderr, "[ERROR] Trial %d: read failed before the overwrite\n", trial);
+        endRead(&reader);
+        goto out;
+    }
+    if (putFile(newData, newSize) < 0) {
+        fprintf(stderr, "[ERROR] Trial %d: overwrite failed\n", trial);
+        endRead(&reader);
+        goto out;
+    }
+    if (readBlocks(&reader, oldSize / BLOCK + 1) < 0 || !reader.done) {
+        fprintf(stderr, "[ERROR] Trial %d: read stopped at %zu of %zu bytes after the overwrite\n", trial, reader.length, oldSize);
+        endRead(&reader);
+        goto out;
+    }
+    if (reader.length != oldSize || memcmp(reader.data, oldData, oldSize) != 0) {
+        fprintf(stderr, "[ERROR] Trial %d: read returned %zu bytes that are not the old file\n", trial, reader.length);
+        endRead(&reader);
+        goto out;
+    }
+    endRead(&reader);
+
+    startRead(&check, oldSize + newSize);
+    if (readBlocks(&check, newSize / BLOCK + 1) < 0 || !check.done ||
+        check.length != newSize || memcmp(check.data, newData, newSize) != 0)
+        fprintf(stderr, "[ERROR] Trial %d: a read after the overwrite did not return the new file\n", trial);
+    else
+        ok = 1;
+    endRead(&check);
+
+out:
+    free(oldData);
+    free(newData);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    char *ip = "127.0.0.1";
+    int port = 8080;
+    int trials = 16;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:p:n:f:")) != -1) {
+        switch (opt) {
+            case 's':
+                ip = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'n':
+                trials = atoi(optarg);
+                break;
+            case 'f':
+                file_name = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s ip] [-p port] [-n trials] [-f file_name]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = inet_addr(ip);
+    srand(getpid());
+
+    /* The new file is alternately smaller and larger than the one being read. */
+    for (int trial = 1; trial <= trials; trial++) {
+        size_t oldSize = 256 * 1024 + rand() % 65536;
+        size_t newSize = trial % 2 ? rand() % 65536 : 512 * 1024 + rand() % 65536;
+        if (!runTrial(trial, oldSize, newSize))
+            exit(EXIT_FAILURE);
+    }
+    printf("[SUCCESS] %d overwrites during a read, all reads intact\n", trials);
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "../Commun/packet.h"
+
+#define PARSES 20000000
+#define SIZE 516
+
+typedef struct {
+    const char *label;
+    char data[SIZE];
+    int len;
+} Sample;
+
+void dieWithError(char *errorMessage) {
+    perror(errorMessage);
+    exit(EXIT_FAILURE);
+}
+
+double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The former server loop: strnlen() to find each field, strcasecmp() and
+   atoi() on them, which assumes a NUL after the last field. */
+long long legacyParse(char *buffer, int n) {
+    char *end = buffer + n;
+    char *filename = buffer + 2;
+    char *mode = filename + strnlen(filename, end - filename) + 1;
+    char *option = mode + strnlen(mode, end > mode ? end - mode : 0) + 1;
+    long long sum = buffer[1] + (mode - filename);
+
+    while (option < end) {
+        char *name = option;
+        char *value = name + strnlen(name, end - name) + 1;
+        if (value > end)
+            value = end;
+        option = value + strnlen(value, end - value) + 1;
+
+        if (strcasecmp(name, "bigfile") == 0)
+            sum += 1;
+        else if (strcasecmp(name, "blksize") == 0)
+            sum += atoi(value);
+        else if (strcasecmp(name, "windowsize") == 0)
+            sum += atoi(value);
+        else if (strcasecmp(name, "tsize") == 0)
+            sum += atoll(value);
+    }
+    return sum;
+}
+
+long long codecParse(char *buffer, int n) {
+    RequestPacket request;
+    if (parseRequest(buffer, n, &request) < 0)
+        return -1;
+
+    long long sum = request.opcode + request.filename.len + 1;
+    for (int i = 0; i < request.optionCount; i++) {
+        StrView name = request.options[i].name;
+        if (viewIs(name, "bigfile"))
+            sum += 1;
+        else if (viewIs(name, "blksize") || viewIs(name, "windowsize") || viewIs(name, "tsize"))
+            sum += viewToNumber(request.options[i].value);
+    }
+    return sum;
+}
+
+void benchmark(Sample *sample) {
+    double start = nowNs();
+    long long legacy = 0;
+    for (int i = 0; i < PARSES; i++) {
+        legacy += legacyParse(sample->data, sample->len);
+        __asm__ volatile("" ::: "memory");
+    }
+    double legacyNs = (nowNs() - start) / PARSES;
+
+    start = nowNs();
+    long long codec = 0;
+    for (int i = 0; i < PARSES; i++) {
+        codec += codecParse(sample->data, sample->len);
+        __asm__ volatile("" ::: "memory");
+    }
+    double codecNs = (nowNs() - start) / PARSES;
+
+    if (legacy != codec)
+        dieWithError("[ERROR] parsers disagree");
+
+    printf("%-22s %4d bytes | legacy %6.1f ns | codec %6.1f ns | %7.0f MB/s\n", sample->label, sample->len,
+           legacyNs, codecNs, sample->len / codecNs * 1e3);
+}
+
+int main(void) {
+    Sample samples[3];
+    int offset;
+
+    samples[0].label = "RRQ";
+    samples[0].len = packRequest(samples[0].data, SIZE, OP_RRQ, "big.bin");
+
+    samples[1].label = "WRQ + 4 options";
+    offset = packRequest(samples[1].data, SIZE, OP_WRQ, "upload/2024/archive.tar.gz");
+    offset = packOption(samples[1].data, SIZE, offset, "bigfile", 1);
+    offset = packOption(samples[1].data, SIZE, offset, "blksize", 1428);
+    offset = packOption(samples[1].data, SIZE, offset, "windowsize", 16);
+    samples[1].len = packOption(samples[1].data, SIZE, offset, "tsize", 1073741824);
+
+    samples[2].label = "RRQ, long name";
+    char name[400];
+    memset(name, 'a', sizeof(name) - 1);
+    name[sizeof(name) - 1] = 0;
+    offset = packRequest(samples[2].data, SIZE, OP_RRQ, name);
+    samples[2].len = packOption(samples[2].data, SIZE, offset, "blksize", 8192);
+
+    for (int i = 0; i < 3; i++) {
+        if (samples[i].len < 0)
+            dieWithError("[ERROR] sample does not fit");
+        samples[i].data[samples[i].len] = 0;
+    }
+
+    printf("[INFO] Request parsing microbenchmark (%d parses per packet)\n", PARSES);
+    for (int i = 0; i < 3; i++)
+        benchmark(&samples[i]);
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "../Commun/packet.h"
+
+/* Fuzz target for the packet codec: every input is decoded as a request, as a
+   bare option list and as an OACK, and the views the codec hands out are
+   checked against the promises of packet.h. A broken promise aborts, which
+   both fuzzers report as a crash.
+
+   libFuzzer:  clang -g -O1 -fsanitize=fuzzer,address -DLIBFUZZER packet_fuzz.c
+               ./a.out fuzz_corpus
+   AFL:        afl-clang-fast -g -O1 packet_fuzz.c
+               afl-fuzz -i fuzz_corpus -o findings ./a.out
+   Replay:     gcc -g -fsanitize=address packet_fuzz.c && ./a.out fuzz_corpus/[a-z]*
+
+   The input is copied to a buffer of its exact size, so a read one byte past
+   the packet is caught by ASan. */
+#define MAX_BLKSIZE 65464
+#define MAX_WINDOWSIZE 65535
+#define MAX_INPUT 65536
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "[ERROR] %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+        abort(); \
+    } \
+} while (0)
+
+/* A view lies inside the packet and is followed by its NUL. */
+void checkView(const char *packet, size_t n, StrView view) {
+    CHECK(view.data >= packet && view.data + view.len < packet + n);
+    CHECK(memchr(view.data, 0, view.len) == NULL);
+    CHECK(view.data[view.len] == 0);
+}
+
+void checkNumber(StrView view) {
+    long long value = viewToNumber(view);
+    CHECK(value >= -1 && value < 1000000000000000000LL);
+    if (value >= 0)
+        CHECK(view.len > 0 && view.len <= 18);
+}
+
+void checkOptions(const char *packet, size_t n, PacketOption *options, int count) {
+    CHECK(count <= PACKET_MAX_OPTIONS);
+    for (int i = 0; i < count; i++) {
+        checkView(packet, n, options[i].name);
+        checkView(packet, n, options[i].value);
+        checkNumber(options[i].value);
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    char *packet = malloc(size > 0 ? size : 1);
+    if (packet == NULL)
+        return 0;
+    memcpy(packet, data, size);
+
+    RequestPacket request;
+    if (parseRequest(packet, size, &request) == 0) {
+        CHECK(request.opcode == OP_RRQ || request.opcode == OP_WRQ);
+        CHECK(request.filename.len > 0);
+        checkView(packet, size, request.filename);
+        checkView(packet, size, request.mode);
+        checkOptions(packet, size, request.options, request.optionCount);
+    }
+
+    PacketOption options[PACKET_MAX_OPTIONS];
+    int count = parseOptionList(packet, packet + size, options, PACKET_MAX_OPTIONS);
+    CHECK(count >= -1);
+    if (count > 0)
+        checkOptions(packet, size, options, count);
+
+    int blksize = MAX_BLKSIZE, windowsize = MAX_WINDOWSIZE, bigfile;
+    long long tsize;
+    if (parseOack(packet, size, &blksize, &windowsize, &tsize, &bigfile) == 0) {
+        CHECK(blksize >= PACKET_MIN_BLKSIZE && blksize <= MAX_BLKSIZE);
+        CHECK(windowsize >= 1 && windowsize <= MAX_WINDOWSIZE);
+        CHECK(tsize >= -1);
+        CHECK(bigfile == 0 || bigfile == 1);
+    }
+
+    free(packet);
+    return 0;
+}
+
+#ifndef LIBFUZZER
+int runFile(FILE *in) {
+    static uint8_t input[MAX_INPUT];
+    size_t n = fread(input, 1, sizeof(input), in);
+    return LLVMFuzzerTestOneInput(input, n);
+}
+
+/* Without libFuzzer: one input on stdin (AFL), or every file given. */
+int main(int argc, char *argv[]) {
+    if (argc < 2)
+        return runFile(stdin);
+
+    for (int i = 1; i < argc; i++) {
+        FILE *in = fopen(argv[i], "rb");
+        if (in == NULL) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        runFile(in);
+        fclose(in);
+    }
+    printf("[INFO] %d inputs decoded\n", argc - 1);
+    return 0;
+}
+#endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "../Serveur/session.h"
+
+#define LOOKUPS 10000000
+#define LIST_LOOKUP_BUDGET 200000000ULL
+
+struct Session {
+    struct sockaddr_in addr;
+};
+
+typedef struct ListNode {
+    Session session;
+    struct ListNode *next;
+} ListNode;
+
+void dieWithError(char *errorMessage) {
+    perror(errorMessage);
+    exit(EXIT_FAILURE);
+}
+
+double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Spread addresses over a /16 and the ephemeral port range, like real clients. */
+struct sockaddr_in makeAddr(unsigned int i) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x0A000000u | ((i / 28000) << 8) | (i % 251));
+    addr.sin_port = htons(32768 + (i * 7919) % 28000);
+    return addr;
+}
+
+ListNode *listFind(ListNode *head, struct sockaddr_in addr) {
+    while (head != NULL) {
+        if (head->session.addr.sin_addr.s_addr == addr.sin_addr.s_addr && head->session.addr.sin_port == addr.sin_port)
+            return head;
+        head = head->next;
+    }
+    return NULL;
+}
+
+void benchmark(unsigned int count) {
+    SessionTable table;
+    Session *sessions = calloc(count, sizeof(Session));
+    ListNode *nodes = calloc(count, sizeof(ListNode));
+    unsigned int *order = malloc(LOOKUPS * sizeof(unsigned int));
+    ListNode *head = NULL;
+    if (sessions == NULL || nodes == NULL || order == NULL || sessionTableInit(&table) < 0)
+        dieWithError("[ERROR] allocation failed");
+
+    for (unsigned int i = 0; i < count; i++) {
+        sessions[i].addr = makeAddr(i);
+        if (sessionInsert(&table, sessions[i].addr, &sessions[i]) < 0)
+            dieWithError("[ERROR] insert failed");
+        nodes[i].session = sessions[i];
+        nodes[i].next = head;
+        head = &nodes[i];
+    }
+
+    srand(42);
+    for (unsigned int i = 0; i < LOOKUPS; i++)
+        order[i] = (unsigned int)rand() % count;
+
+    double start = nowNs();
+    unsigned long found = 0;
+    for (unsigned int i = 0; i < LOOKUPS; i++)
+        found += sessionLookup(&table, sessions[order[i]].addr) != NULL;
+    double tableNs = (nowNs() - start) / LOOKUPS;
+    if (found != LOOKUPS)
+        dieWithError("[ERROR] table lookup missed a session");
+
+    unsigned long listLookups = LIST_LOOKUP_BUDGET / count;
+    if (listLookups > LOOKUPS)
+        listLookups = LOOKUPS;
+    start = nowNs();
+    found = 0;
+    for (unsigned long i = 0; i < listLookups; i++)
+        found += listFind(head, sessions[order[i]].addr) != NULL;
+    double listNs = (nowNs() - start) / listLookups;
+
+    /* Churn: remove and re-insert every session to exercise backward-shift deletion. */
+    start = nowNs();
+    for (unsigned int i = 0; i < count; i++) {
+        if (sessionRemove(&table, sessions[i].addr) != &sessions[i])
+            dieWithError("[ERROR] remove returned the wrong session");
+        if (sessionInsert(&table, sessions[i].addr, &sessions[i]) < 0)
+            dieWithError("[ERROR] insert failed");
+    }
+    double churnNs = (nowNs() - start) / count;
+    for (unsigned int i = 0; i < count; i++) {
+        if (sessionLookup(&table, sessions[i].addr) != &sessions[i])
+            dieWithError("[ERROR] lookup after churn failed");
+    }
+
+    printf("%8u sessions | table lookup %7.1f ns | list lookup %10.1f ns | remove+insert %7.1f ns\n",
+           count, tableNs, listNs, churnNs);
+
+    sessionTableDestroy(&table);
+    free(order);
+    free(nodes);
+    free(sessions);
+}
+
+int main(void) {
+    unsigned int sizes[] = { 10, 1000, 100000 };
+
+    printf("[INFO] Session lookup microbenchmark (%d random lookups per size)\n", LOOKUPS);
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        benchmark(sizes[i]);
+    return 0;
+}
@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "../Commun/rto.h"
+#include "../Commun/packet.h"
+
+/* tftp-bench: one process, one epoll loop, N transfers in flight at once
+   against any of the servers (Etape3 mono/multithread, Etape4). As soon as a
+   transfer ends, the next one takes its slot, until -n transfers are done or
+   -d seconds have passed.
+
+   Without -b/-w the requests are plain RFC 1350 ones (512-byte blocks, one
+   block in flight), which every server understands. With -b/-w they carry
+   bigfile, blksize, windowsize and tsize, as the Etape4 client does. A WRQ
+   uploads -z bytes to a new bench-<pid>-<n>.bin file in the server directory
+   (Etape3 refuses to overwrite a file); a RRQ downloads -f, which must exist.
+   The Etape3 monothread server serves one client at a time: use -c 1. */
+#define SIZE 516
+#define MAX_BLKSIZE 65464
+#define MAX_WINDOWSIZE 65535
+#define EPOLL_BATCH 256
+#define TIMER_SCAN_US 1000
+
+enum { MODE_RRQ, MODE_WRQ, MODE_MIX };
+
+typedef struct {
+    int sockfd;
+    int active;
+    int isRead;
+    int answered;
+    struct sockaddr_in peer;
+    int blksize;
+    int windowsize;
+    int bigfile;
+    long long base;
+    long long next;
+    long long lastBlock;
+    long long bytes;
+    int sinceAck;
+    int gapAcked;
+    int retries;
+    long long deadline;
+    long long startedAt;
+    char request[SIZE];
+    int requestLen;
+} BenchSession;
+
+typedef struct {
+    long long completed;
+    long long failed;
+    long long bytes;
+    long long packetsSent;
+    long long packetsReceived;
+    long long retransmits;
+    long long *latencies;
+    long long latencyCount;
+    long long latencyCapacity;
+} BenchStats;
+
+struct sockaddr_in server_addr;
+int epfd;
+int mode = MODE_RRQ;
+const char *read_file = NULL;
+long long write_size = 1 << 20;
+int use_options = 0;
+int blksize = 512;
+int windowsize = 1;
+long long timeout_us = 200000;
+int max_retries = 10;
+long long started = 0;
+char packet[4 + MAX_BLKSIZE];
+char payload[MAX_BLKSIZE];
+BenchStats stats;
+
+void dieWithError(char *errorMessage) {
+    perror(errorMessage);
+    exit(EXIT_FAILURE);
+}
+
+void sendTo(BenchSession *session, struct sockaddr_in *addr, const char *data, int len) {
+    if (sendto(session->sockfd, data, len, 0, (struct sockaddr *)addr, sizeof(*addr)) == len)
+        stats.packetsSent++;
+}
+
+void sendAck(BenchSession *session, long long index) {
+    char ack[4] = { 0, OP_ACK, 0, 0 };
+    int block = wireBlock(index, session->bigfile);
+    ack[2] = (char)(block >> 8);
+    ack[3] = (char)block;
+    sendTo(session, &session->peer, ack, sizeof(ack));
+}
+
+void sendData(BenchSession *session, long long index) {
+    int len = index == session->lastBlock ? (int)(write_size % session->blksize) : session->blksize;
+    int block = wireBlock(index, session->bigfile);
+    packet[0] = 0;
+    packet[1] = OP_DATA;
+    packet[2] = (char)(block >> 8);
+    packet[3] = (char)block;
+    memcpy(packet + 4, payload, len);
+    sendTo(session, &session->peer, packet, 4 + len);
+}
+
+/* WRQ sender: keeps up to windowsize unacknowledged blocks on the wire. */
+void fillWindow(BenchSession *session) {
+    while (session->next <= session->lastBlock && session->next < session->base + session->windowsize)
+        sendData(session, session->next++);
+}
+
+void recordLatency(long long latency) {
+    if (stats.latencyCount == stats.latencyCapacity) {
+        stats.latencyCapacity = stats.latencyCapacity ? stats.latencyCapacity * 2 : 4096;
+        stats.latencies = realloc(stats.latencies, stats.latencyCapacity * sizeof(long long));
+        if (stats.latencies == NULL)
+            dieWithError("[ERROR] malloc error");
+    }
+    stats.latencies[stats.latencyCount++] = latency;
+}
+
+void endSession(BenchSession *session, int failed) {
+    if (failed) {
+        stats.failed++;
+    } else {
+        stats.completed++;
+        stats.bytes += session->bytes;
+        recordLatency(monotonicUs() - session->startedAt);
+    }
+    close(session->sockfd);
+    session->active = 0;
+}
+
+void startSession(BenchSession *session) {
+    memset(session, 0, sizeof(*session));
+    session->isRead = mode == MODE_RRQ || (mode == MODE_MIX && started % 2 == 0);
+    session->blksize = 512;
+    session->windowsize = 1;
+
+    char name[64];
+    const char *fileName = read_file;
+    if (!session->isRead) {
+        snprintf(name, sizeof(name), "bench-%d-%lld.bin", (int)getpid(), started);
+        fileName = name;
+    }
+    started++;
+
+    int len = packRequest(session->request, SIZE, session->isRead ? OP_RRQ : OP_WRQ, fileName);
+    if (use_options) {
+        len = packOption(session->request, SIZE, len, "bigfile", 1);
+        len = packOption(session->request, SIZE, len, "blksize", blksize);
+        len = packOption(session->request, SIZE, len, "windowsize", windowsize);
+        len = packOption(session->request, SIZE, len, "tsize", session->isRead ? 0 : write_size);
+    }
+    if (len < 0) {
+        errno = ENAMETOOLONG;
+        dieWithError("[ERROR] File name too long");
+    }
+    session->requestLen = len;
+
+    session->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (session->sockfd < 0)
+        dieWithError("[ERROR] socket error");
+    fcntl(session->sockfd, F_SETFL, fcntl(session->sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = session;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, session->sockfd, &event) < 0)
+        dieWithError("[ERROR] epoll_ctl error");
+
+    session->active = 1;
+    session->startedAt = monotonicUs();
+    session->deadline = session->startedAt + timeout_us;
+    sendTo(session, &server_addr, session->request, session->requestLen);
+}
+
+/* Takes the parameters the server accepted; it may only lower them. */
+int applyOack(BenchSession *session, int n) {
+    int acceptedBlksize = blksize, acceptedWindowsize = windowsize;
+    long long tsize;
+    if (parseOack(packet, n, &acceptedBlksize, &acceptedWindowsize, &tsize, &session->bigfile) < 0)
+        return -1;
+    session->blksize = acceptedBlksize;
+    session->windowsize = acceptedWindowsize;
+    return 0;
+}
+
+/* First answer of the server: an OACK fixes the transfer parameters, anything
+   else means it ignored the options and RFC 1350 defaults apply. */
+int acceptAnswer(BenchSession *session, int opcode, int n) {
+    session->answered = 1;
+    session->base = 1;
+    session->next = 1;
+    if (opcode == OP_OACK && applyOack(session, n) < 0)
+        return -1;
+    session->lastBlock = write_size / session->blksize + 1;
+
+    /* A RRQ acknowledges the OACK with ACK 0; a plain one is already at DATA 1.
+       A WRQ starts sending on the OACK or on ACK 0. */
+    if (session->isRead && opcode == OP_OACK)
+        sendAck(session, 0);
+    else if (!session->isRead)
+        fillWindow(session);
+    return 0;
+}
+
+/* RFC 7440 receiver: ACK every windowsize blocks, the final block, and the
+   last in-order block once when the sender is out of step. */
+void handleData(BenchSession *session, int n) {
+    int block = (unsigned char)packet[2] << 8 | (unsigned char)packet[3];
+
+    if (block != wireBlock(session->base, session->bigfile)) {
+        if (!session->gapAcked) {
+            sendAck(session, session->base - 1);
+            session->gapAcked = 1;
+        }
+        return;
+    }
+
+    int final = n - 4 < session->blksize;
+    session->bytes += n - 4;
+    session->base++;
+    session->retries = 0;
+    session->gapAcked = 0;
+    session->deadline = monotonicUs() + timeout_us;
+    if (++session->sinceAck >= session->windowsize || final) {
+        sendAck(session, session->base - 1);
+        session->sinceAck = 0;
+    }
+    if (final)
+        endSession(session, 0);
+}
+
+void handleAck(BenchSession *session) {
+    int block = (unsigned char)packet[2] << 8 | (unsigned char)packet[3];
+    long long index = blockIndex(block, session->base - 1, session->next - 1, session->bigfile);
+
+    if (index < session->base)
+        return;
+    for (long long i = session->base; i <= index; i++)
+        session->bytes += i == session->lastBlock ? write_size % session->blksize : session->blksize;
+    session->base = index + 1;
+    session->retries = 0;
+    session->deadline = monotonicUs() + timeout_us;
+    if (session->base > session->lastBlock)
+        endSession(session, 0);
+    else
+        fillWindow(session);
+}
+
+void onReadable(BenchSession *session) {
+    struct sockaddr_in from;
+    socklen_t fromLen;
+
+    while (session->active) {
+        fromLen = sizeof(from);
+        int n = recvfrom(session->sockfd, packet, sizeof(packet), 0, (struct sockaddr *)&from, &fromLen);
+        if (n < 0)
+            return;
+        stats.packetsReceived++;
+
+        /* The first answer gives the server's TID; other ports are ignored. */
+        if (!session->answered)
+            session->peer = from;
+        else if (from.sin_port != session->peer.sin_port || from.sin_addr.s_addr != session->peer.sin_addr.s_addr)
+            continue;
+
+        int opcode = packetOpcode(packet, n);
+        if (opcode == OP_ERROR || n < 4) {
+            endSession(session, 1);
+            return;
+        }
+        if (!session->answered && acceptAnswer(session, opcode, n) < 0) {
+            endSession(session, 1);
+            return;
+        }
+        if (opcode == OP_DATA && session->isRead)
+            handleData(session, n);
+        else if (opcode == OP_ACK && !session->isRead)
+            handleAck(session);
+    }
+}
+
+/* Resends the request until the server answers, then the last ACK (RRQ) or the
+   whole window from the first unacknowledged block (WRQ). */
+void onTimeout(BenchSession *session, long long now) {
+    if (++session->retries > max_retries) {
+        endSession(session, 1);
+        return;
+    }
+    stats.retransmits++;
+    session->deadline = now + timeout_us;
+    if (!session->answered) {
+        sendTo(session, &server_addr, session->request, session->requestLen);
+    } else if (session->isRead) {
+        sendAck(session, session->base - 1);
+    } else {
+        session->next = session->base;
+        fillWindow(session);
+    }
+}
+
+int compareLatency(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentileMs(double percentile) {
+    if (stats.latencyCount == 0)
+        return 0.0;
+    long long rank = (long long)(percentile * stats.latencyCount / 100.0);
+    if (rank >= stats.latencyCount)
+        rank = stats.latencyCount - 1;
+    return stats.latencies[rank] / 1000.0;
+}
+
+/* Every slot is a socket: lift the descriptor limit as far as allowed. */
+void raiseFileLimit(int needed) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)needed + 16) {
+        limit.rlim_cur = (rlim_t)needed + 16 < limit.rlim_max ? (rlim_t)needed + 16 : limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    char *ip = "127.0.0.1";
+    int port = 8080;
+    int concurrency = 16;
+    long long total = 0;
+    double duration = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:p:c:n:d:m:f:z:b:w:t:r:")) != -1) {
+        switch (opt) {
+            case 's':
+                ip = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            case 'n':
+                total = atoll(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'm':
+                mode = strcmp(optarg, "wrq") == 0 ? MODE_WRQ : strcmp(optarg, "mix") == 0 ? MODE_MIX : MODE_RRQ;
+                break;
+            case 'f':
+                read_file = optarg;
+                break;
+            case 'z':
+                write_size = atoll(optarg);
+                break;
+            case 'b':
+                blksize = atoi(optarg);
+                use_options = 1;
+                break;
+            case 'w':
+                windowsize = atoi(optarg);
+                use_options = 1;
+                break;
+            case 't':
+                timeout_us = atoll(optarg) * 1000;
+                break;
+            case 'r':
+                max_retries = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s ip] [-p port] [-c concurrent] [-n transfers | -d seconds] [-m rrq|wrq|mix]\n"
+                                "          [-f file_to_read] [-z bytes_to_write] [-b blksize] [-w windowsize] [-t timeout_ms] [-r retries]\n",
+                        argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (mode != MODE_WRQ && read_file == NULL) {
+        fprintf(stderr, "[ERROR] -f is required for RRQ transfers\n");
+        exit(EXIT_FAILURE);
+    }
+    if (concurrency < 1)
+        concurrency = 1;
+    if (blksize < 8 || blksize > MAX_BLKSIZE)
+        blksize = 512;
+    if (windowsize < 1 || windowsize > MAX_WINDOWSIZE)
+        windowsize = 1;
+    if (write_size < 0)
+        write_size = 0;
+    if (total <= 0 && duration <= 0)
+        total = concurrency;
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = inet_addr(ip);
+    for (int i = 0; i < MAX_BLKSIZE; i++)
+        payload[i] = (char)(i * 31 + 7);
+
+    raiseFileLimit(concurrency);
+    epfd = epoll_create1(0);
+    if (epfd < 0)
+        dieWithError("[ERROR] epoll_create1 error");
+    BenchSession *sessions = calloc(concurrency, sizeof(BenchSession));
+    if (sessions == NULL)
+        dieWithError("[ERROR] malloc error");
+
+    printf("[INFO] tftp-bench: %d concurrent %s to %s:%d, blksize %d, windowsize %d%s\n", concurrency,
+           mode == MODE_RRQ ? "RRQ" : mode == MODE_WRQ ? "WRQ" : "RRQ/WRQ", ip, port, blksize, windowsize,
+           use_options ? "" : " (no options)");
+
+    long long start = monotonicUs();
+    long long stopAt = duration > 0 ? start + (long long)(duration * 1e6) : 0;
+    long long lastScan = start;
+    int active = 0;
+    struct epoll_event events[EPOLL_BATCH];
+
+    while (1) {
+        long long now = monotonicUs();
+        int more = stopAt ? now < stopAt : started < total;
+
+        active = 0;
+        for (int i = 0; i < concurrency; i++) {
+            if (!sessions[i].active && more) {
+                startSession(&sessions[i]);
+                more = stopAt ? 1 : started < total;
+            }
+            active += sessions[i].active;
+        }
+        if (active == 0)
+            break;
+
+        int n = epoll_wait(epfd, events, EPOLL_BATCH, 1);
+        if (n < 0 && errno != EINTR)
+            dieWithError("[ERROR] epoll_wait error");
+        for (int i = 0; i < n; i++)
+            onReadable(events[i].data.ptr);
+
+        /* Deadlines are checked by scanning the slots, at most every TIMER_SCAN_US. */
+        now = monotonicUs();
+        if (now - lastScan >= TIMER_SCAN_US) {
+            lastScan = now;
+            for (int i = 0; i < concurrency; i++)
+                if (sessions[i].active && sessions[i].deadline <= now)
+                    onTimeout(&sessions[i], now);
+        }
+    }
+
+    double seconds = (monotonicUs() - start) / 1e6;
+    qsort(stats.latencies, stats.latencyCount, sizeof(long long), compareLatency);
+
+    printf("[STATS] %lld transfers (%lld failed) in %.2f s, %lld retransmissions\n", stats.completed, stats.failed,
+           seconds, stats.retransmits);
+    printf("[STATS] %.2f MB/s | %.0f packets/s | %.1f transfers/s\n", stats.bytes / seconds / 1e6,
+           (stats.packetsSent + stats.packetsReceived) / seconds, stats.completed / seconds);
+    printf("[STATS] latency p50 %.2f ms | p99 %.2f ms | p999 %.2f ms\n", percentileMs(50), percentileMs(99),
+           percentileMs(99.9));
+
+    free(stats.latencies);
+    free(sessions);
+    close(epfd);
+    return stats.failed > 0;
+}
@@ -1,15 +1,38 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
 #include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <sys/stat.h>
+
+#include "../Commun/rto.h"
+#include "../Commun/writebehind.h"
+#include "../Commun/pool.h"
+#include "../Commun/packet.h"
+#include "../Commun/log.h"
+#include "../Commun/histogram.h"
 
 #define SIZE 516
-#define TIMEOUT 5
 #define MAX_RETRIES 3
+#define DEFAULT_BLKSIZE 1428
+#define MAX_BLKSIZE 65464
+#define DEFAULT_WINDOWSIZE 16
+#define MAX_WINDOWSIZE 65535
+
+
+
+/* Time to first block, block RTTs and transfer time, printed at exit. */
+TransferLatency client_latency;
+
+/* The sender's window comes from here, so it is carved out once and a later
+   transfer of the same size reuses it. */
+BufferPool client_buffers;
 
 
 
@@ -20,56 +43,153 @@ void dieWithError(char *errorMessage) {
 
 
 
-int receiveServerResponse(int sockfd, int expectedBlockNumber, struct sockaddr_in *addr) {
-    char ackBuffer[SIZE];
-    socklen_t addr_size = sizeof(struct sockaddr_in);
-    struct timeval timeout;
-    
-    
-    timeout.tv_sec = TIMEOUT;
-    timeout.tv_usec = 0;
-    
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) < 0) {
-        dieWithError("[ERROR] setsockopt() failed");
+/* Builds a RRQ/WRQ for fileName and returns its length. The name must fit in
+   one packet. */
+int buildRequest(char *buffer, int capacity, int opcode, const char *fileName) {
+    int packetLength = packRequest(buffer, capacity, opcode, fileName);
+    if (packetLength < 0) {
+        errno = ENAMETOOLONG;
+        dieWithError("[ERROR] File name too long");
+    }
+    return packetLength;
+}
+
+
+
+/* Same with "bigfile", "blksize", "windowsize" and "tsize" after the mode. */
+int buildOptionRequest(char *buffer, int capacity, int opcode, const char *fileName, int blksize, int windowsize, long long tsize) {
+    int packetLength = packRequest(buffer, capacity, opcode, fileName);
+    packetLength = packOption(buffer, capacity, packetLength, "bigfile", 1);
+    packetLength = packOption(buffer, capacity, packetLength, "blksize", blksize);
+    packetLength = packOption(buffer, capacity, packetLength, "windowsize", windowsize);
+    packetLength = packOption(buffer, capacity, packetLength, "tsize", tsize);
+    if (packetLength < 0) {
+        errno = ENAMETOOLONG;
+        dieWithError("[ERROR] File name too long");
     }
+    return packetLength;
+}
+
+
+
+/* Receive timeouts follow the RTO of the transfer. */
+void setReceiveTimeout(int sockfd, long long timeoutUs) {
+    struct timeval tv;
+    tv.tv_sec = timeoutUs / 1000000;
+    tv.tv_usec = timeoutUs % 1000000;
     
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv) < 0)
+        dieWithError("[ERROR] setsockopt failed");
+}
+
+
+
+/* Registered before the logger starts, so it runs once the last line is out. */
+void printClientLatency(void) {
+    if (histogramCount(&client_latency.setup) > 0)
+        printTransferLatency(stdout, &client_latency);
+}
+
+
+
+void printTransferStats(RttEstimator *rtt, long long blocks, int retransmits) {
+    LOG(LOG_INFO, "event=transfer_stats blocks=%lld retransmits=%d srtt_ms=%.2f rto_ms=%.2f", blocks, retransmits, rtt->srtt / 1000.0, rtt->rto / 1000.0);
+}
+
+
+
+void sendAckPacket(int sockfd, struct sockaddr_in *addr, int block) {
+    char ackPacket[4];
+    ackPacket[0] = 0;
+    ackPacket[1] = 4;
+    ackPacket[2] = (block >> 8) & 0xFF;
+    ackPacket[3] = block & 0xFF;
     
-    int n = recvfrom(sockfd, ackBuffer, sizeof(ackBuffer), 0, (struct sockaddr *) addr, &addr_size);
+    if (sendto(sockfd, ackPacket, sizeof(ackPacket), 0, (struct sockaddr *) addr, sizeof(*addr)) < 0)
+        dieWithError("[ERROR] sendto error");
+}
+
+
+
+/* Waits for any ACK and returns its block number, -1 on timeout. An ERROR
+   packet aborts the transfer. */
+int receiveAck(int sockfd, struct sockaddr_in *addr) {
+    char ackBuffer[SIZE];
+    socklen_t addr_size = sizeof(struct sockaddr_in);
     
-    if (n < 0) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            printf("[ERROR] Timeout occurred while waiting for ACK.\n");
-            return -1;
-        }
-        else {
+    while (1) {
+        int n = recvfrom(sockfd, ackBuffer, sizeof(ackBuffer) - 1, 0, (struct sockaddr *) addr, &addr_size);
+        
+        if (n < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                LOG(LOG_ERROR, "event=timeout waiting=ack");
+                return -1;
+            }
             dieWithError("[ERROR] receiving ACK");
         }
+        
+        if (n >= 4 && ackBuffer[1] == 4) {
+            int blockNumber = (unsigned char) ackBuffer[2] << 8 | (unsigned char) ackBuffer[3];
+            LOG_SAMPLED(LOG_DEBUG, "event=ack block=%d", blockNumber);
+            return blockNumber;
+        }
+        
+        if (n >= 4 && ackBuffer[1] == 5) {
+            ackBuffer[n] = 0;
+            LOG(LOG_ERROR, "event=server_error message=\"%s\"", ackBuffer + 4);
+            exit(EXIT_FAILURE);
+        }
     }
+}
+
+
+
+/* Waits for the ACK of expectedBlockNumber, -1 on timeout or error. ACKs of
+   other blocks are retransmissions answered by the server and are skipped. */
+int receiveServerResponse(int sockfd, int expectedBlockNumber, struct sockaddr_in *addr) {
+    char ackBuffer[SIZE];
+    socklen_t addr_size = sizeof(struct sockaddr_in);
     
-    
-    if (ackBuffer[1] != 4) {
+    while (1) {
+        int n = recvfrom(sockfd, ackBuffer, sizeof(ackBuffer) - 1, 0, (struct sockaddr *) addr, &addr_size);
+        
+        if (n < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                LOG(LOG_ERROR, "event=timeout waiting=ack");
+                return -1;
+            }
+            else {
+                dieWithError("[ERROR] receiving ACK");
+            }
+        }
+        
         
-        if (ackBuffer[1] == 5) printf("[ERROR] Received error packet from server: %s\n", ackBuffer + 4);
-        else printf("[ERROR] Undefined error\n");
-        return -1;
+        if (n < 4 || ackBuffer[1] != 4) {
+            ackBuffer[n > 4 ? n : 4] = 0;
+            if (n >= 4 && ackBuffer[1] == 5) LOG(LOG_ERROR, "event=server_error message=\"%s\"", ackBuffer + 4);
+            else LOG(LOG_ERROR, "event=unexpected_packet");
+            return -1;
+        }
+        
+        
+        int blockNumber = (unsigned char) ackBuffer[2] << 8 | (unsigned char) ackBuffer[3];
+        
+        
+        if (blockNumber == expectedBlockNumber) {
+            LOG_SAMPLED(LOG_DEBUG, "event=ack block=%d", blockNumber);
+            return 0;
+        }
     }
-    
-    
-    int blockNumber = (unsigned char) ackBuffer[2] << 8 | (unsigned char) ackBuffer[3];
-    
-    
-    if (blockNumber != expectedBlockNumber)
-        dieWithError("[ERROR] Unexpected block number in ACK");
-    
-    printf("[INFO] Received ACK for block %d\n", blockNumber);
-    return 0;
 }
 
 
 
 void send_WRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
     char buffer[SIZE];
-    int n, readBytes, blockNumber = 0, retries;
+    int n, readBytes, blockNumber = 0, retries, retransmits = 0;
+    RttEstimator rtt;
+    
+    rttInit(&rtt);
     
     
     FILE *fp = fopen(fileName, "rb");
@@ -79,15 +199,11 @@ void send_WRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
     }
     
     
-    memset(buffer, 0, SIZE);
-    buffer[1] = 2;
-    strcpy(buffer + 2, fileName);
-    strcpy(buffer + 2 + strlen(fileName) + 1, "octet");
-    
-    
-    int packetLength = 2 + strlen(fileName) + 1 + strlen("octet") + 1;
+    int packetLength = buildRequest(buffer, SIZE, OP_WRQ, fileName);
     
     
+    long long sentAt = monotonicUs();
+    long long requestedAt = sentAt;
     n = sendto(sockfd, buffer, packetLength, 0, (struct sockaddr *) &addr, sizeof(addr));
     
     if (n < 0) {
@@ -96,11 +212,13 @@ void send_WRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
     }
     
     
+    setReceiveTimeout(sockfd, RTO_GIVE_UP_US);
     if (receiveServerResponse(sockfd, 0, &addr) != 0) {
         
         fclose(fp);
         exit(EXIT_FAILURE);
     }
+    rttSample(&rtt, monotonicUs() - sentAt);
     
     
     memset(buffer, 0, SIZE);
@@ -110,50 +228,63 @@ void send_WRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
         blockNumber++;
         retries = 0;
         
-        while (retries < MAX_RETRIES) {
-            printf("[SENDING] Block %d\n", blockNumber);
+        /* Karn: only a block acknowledged on its first transmission gives an RTT sample. */
+        while (1) {
+            LOG_SAMPLED(LOG_DEBUG, "event=send block=%d", blockNumber);
             buffer[1] = 3;
             buffer[2] = (blockNumber >> 8) & 0xFF;
             buffer[3] = blockNumber & 0xFF;
             
             
+            setReceiveTimeout(sockfd, rtt.rto);
+            sentAt = monotonicUs();
             n = sendto(sockfd, buffer, readBytes + 4, 0, (struct sockaddr *) &addr, sizeof(addr));
             
             if (n < 0) {
-                if (retries == MAX_RETRIES) {
-                    fclose(fp);
-                    dieWithError("[ERROR] sending block to the server after max retries.");
-                }
-                printf("[RETRY] Retrying sendto...\n");
-                retries++;
-                continue;
+                fclose(fp);
+                dieWithError("[ERROR] sending block to the server.");
             }
             
             
-            if (receiveServerResponse(sockfd, blockNumber, &addr) == 0)
+            if (receiveServerResponse(sockfd, blockNumber, &addr) == 0) {
+                long long now = monotonicUs();
+                if (retries == 0) {
+                    rttSample(&rtt, now - sentAt);
+                    histogramRecord(&client_latency.blockRtt, now - sentAt);
+                }
+                if (blockNumber == 1)
+                    histogramRecord(&client_latency.setup, now - requestedAt);
+                rttProgress(&rtt);
                 break;
+            }
             
             else {
-                if (retries == MAX_RETRIES) {
+                rttBackoff(&rtt);
+                if (rttExpired(&rtt, ++retries, MAX_RETRIES)) {
                     fclose(fp);
                     dieWithError("[ERROR] No ACK received for block after max retries.");
                 }
-                printf("[RETRY] No ACK for block, retrying...\n");
-                retries++;
+                LOG(LOG_INFO, "event=retransmit");
+                retransmits++;
             }
         }
         memset(buffer, 0, SIZE);
     }
     
-    printf("[SUCCESS] File sent successfully.\n");
+    histogramRecord(&client_latency.transfer, monotonicUs() - requestedAt);
+    LOG(LOG_INFO, "event=transfer_done op=wrq");
+    printTransferStats(&rtt, blockNumber, retransmits);
     fclose(fp);
 }
 
 
-void send_BIGWRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
+void send_BIGWRQ(const char *fileName, int sockfd, struct sockaddr_in addr, int blksize, int windowsize) {
     char buffer[SIZE];
-    int n, readBytes, blockNumber = 0, retries;
+    int n, retries, retransmits = 0;
     socklen_t addr_size = sizeof(struct sockaddr_in);
+    RttEstimator rtt;
+    
+    rttInit(&rtt);
     
     
     FILE *fp = fopen(fileName, "rb");
@@ -161,14 +292,14 @@ void send_BIGWRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
         dieWithError("[ERROR] Could not open file for reading");
     }
     
+    /* The server uses the size to reserve the file up front. */
+    struct stat st;
+    long long tsize = fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0;
     
-    memset(buffer, 0, SIZE);
-    buffer[1] = 2;
-    strcpy(buffer + 2, fileName);
-    strcpy(buffer + 2 + strlen(fileName) + 1, "octet");
-    strcpy(buffer + 2 + strlen(fileName) + 1 + strlen("octet") + 1, "bigfile");
-    int packetLength = 2 + strlen(fileName) + 1 + strlen("octet") + 1 + strlen("bigfile");
+    int packetLength = buildOptionRequest(buffer, SIZE, OP_WRQ, fileName, blksize, windowsize, tsize);
     
+    long long sentAt = monotonicUs();
+    long long requestedAt = sentAt;
     n = sendto(sockfd, buffer, packetLength, 0, (struct sockaddr *)&addr, sizeof(addr));
     if (n < 0) {
         fclose(fp);
@@ -176,12 +307,12 @@ void send_BIGWRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
     }
     
     
+    setReceiveTimeout(sockfd, RTO_GIVE_UP_US);
     
     n = recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&addr, &addr_size);
-    printf("[INFO] Reception \n %d", buffer[1]);
     if (n < 0) {
         if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            printf("[ERROR] Timeout occurred while waiting for ACK.\n");
+            LOG(LOG_ERROR, "event=timeout waiting=ack");
             fclose(fp);
             exit(EXIT_FAILURE);
         } else {
@@ -190,68 +321,132 @@ void send_BIGWRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
         }
     }
     
-    if (buffer[1] == 6) {
-        
-        memset(buffer, 0, SIZE);
-        
-        while ((readBytes = fread(buffer + 4, 1, 512, fp)) > 0) {
-            if (blockNumber < 65355){
-                blockNumber++;
-            }else{
-                blockNumber = 1;
-            }
-            retries = 0;
+    if (buffer[1] != 6) {
+        fclose(fp);
+        dieWithError("[ERROR] rejection of the option deal");
+    }
+    
+    int bigfile;
+    if (parseOack(buffer, n, &blksize, &windowsize, &tsize, &bigfile) < 0) {
+        fclose(fp);
+        dieWithError("[ERROR] Server answered with invalid options");
+    }
+    LOG(LOG_INFO, "event=negotiated blksize=%d windowsize=%d", blksize, windowsize);
+    rttSample(&rtt, monotonicUs() - sentAt);
+    
+    /* Sliding window (RFC 7440): blocks [base, next) are in flight and kept in
+       the window buffer until acknowledged, so a retransmission never re-reads
+       the file. */
+    size_t windowBytes = (size_t)windowsize * (4 + blksize);
+    char *window = bufferGet(&client_buffers, windowBytes);
+    int *lengths = bufferGet(&client_buffers, windowsize * sizeof(int));
+    if (window == NULL || lengths == NULL)
+        dieWithError("[ERROR] malloc error");
+    
+    long long base = 1, next = 1, readIndex = 0, lastBlock = 0;
+    int dupAckHandled = 0;
+    retries = 0;
+    
+    /* One block at a time is timed, from its first transmission to the ACK
+       that covers it; -1 when no sample is running. */
+    long long timedBlock = -1, timedAt = 0, highestSent = 0, resentThrough = 0;
+    
+    while (1) {
+        while (next < base + windowsize && (lastBlock == 0 || next <= lastBlock)) {
+            char *packet = window + (size_t)(next % windowsize) * (4 + blksize);
+            int slot = next % windowsize;
             
-            while (retries < MAX_RETRIES) {
-                printf("[SENDING] Block %d\n", blockNumber);
-                buffer[1] = 3;
-                buffer[2] = (blockNumber >> 8) & 0xFF;
-                buffer[3] = blockNumber & 0xFF;
-                
-                
-                n = sendto(sockfd, buffer, readBytes + 4, 0, (struct sockaddr *) &addr, sizeof(addr));
-                
-                if (n < 0) {
-                    if (retries == MAX_RETRIES) {
-                        fclose(fp);
-                        dieWithError("[ERROR] sending block to the server after max retries.");
-                    }
-                    printf("[RETRY] Retrying sendto...\n");
-                    retries++;
-                    continue;
-                }
-                
-                
-                if (receiveServerResponse(sockfd, blockNumber, &addr) == 0)
-                    break;
-                
-                else {
-                    if (retries == MAX_RETRIES) {
-                        fclose(fp);
-                        dieWithError("[ERROR] No ACK received for block after max retries.");
-                    }
-                    printf("[RETRY] No ACK for block, retrying...\n");
-                    retries++;
-                }
+            if (next > readIndex) {
+                lengths[slot] = fread(packet + 4, 1, blksize, fp);
+                readIndex = next;
+                if (lengths[slot] < blksize)
+                    lastBlock = next;
             }
-            memset(buffer, 0, SIZE);
             
+            int blockNumber = wireBlock(next, bigfile);
+            LOG_SAMPLED(LOG_DEBUG, "event=send block=%d", blockNumber);
+            packet[0] = 0;
+            packet[1] = 3;
+            packet[2] = (blockNumber >> 8) & 0xFF;
+            packet[3] = blockNumber & 0xFF;
+            
+            if (sendto(sockfd, packet, lengths[slot] + 4, 0, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+                dieWithError("[ERROR] sending block to the server.");
             
+            if (next > highestSent) {
+                highestSent = next;
+                if (timedBlock < 0) {
+                    timedBlock = next;
+                    timedAt = monotonicUs();
+                }
+            } else {
+                retransmits++;
+                resentThrough = next;
+                if (timedBlock >= next)
+                    timedBlock = -1;
+            }
+            next++;
         }
         
-        printf("[SUCCESS] File sent successfully.\n");
-        fclose(fp);
-    }else{
-        fclose(fp);
-        dieWithError("[ERROR] rejection of the option deal");
+        setReceiveTimeout(sockfd, rtt.rto);
+        int blockNumber = receiveAck(sockfd, &addr);
+        if (blockNumber < 0) {
+            rttBackoff(&rtt);
+            if (rttExpired(&rtt, ++retries, MAX_RETRIES)) {
+                fclose(fp);
+                dieWithError("[ERROR] No ACK received for block after max retries.");
+            }
+            LOG(LOG_INFO, "event=retransmit from_block=%d", wireBlock(base, bigfile));
+            next = base;
+            continue;
+        }
+        
+        long long index = blockIndex(blockNumber, base - 1, next - 1, bigfile);
+        if (index < 0)
+            continue;
+        
+        if (timedBlock >= 0 && index >= timedBlock) {
+            rttSample(&rtt, monotonicUs() - timedAt);
+            histogramRecord(&client_latency.blockRtt, monotonicUs() - timedAt);
+            timedBlock = -1;
+        }
+        
+        if (index == base - 1) {
+            /* The first duplicate ACK means a block of the window was lost,
+               unless it answers a block we sent twice ourselves. */
+            if (!dupAckHandled && next > base && index > resentThrough) {
+                dupAckHandled = 1;
+                next = base;
+            }
+            continue;
+        }
+        
+        retries = 0;
+        rttProgress(&rtt);
+        dupAckHandled = 0;
+        if (base == 1)
+            histogramRecord(&client_latency.setup, monotonicUs() - requestedAt);
+        if (lastBlock != 0 && index == lastBlock)
+            break;
+        base = index + 1;
+        next = base;
     }
+    
+    histogramRecord(&client_latency.transfer, monotonicUs() - requestedAt);
+    LOG(LOG_INFO, "event=transfer_done op=wrq");
+    printTransferStats(&rtt, lastBlock, retransmits);
+    bufferPut(&client_buffers, lengths, windowsize * sizeof(int));
+    bufferPut(&client_buffers, window, windowBytes);
+    fclose(fp);
 }
 
-void send_BIGRRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
+void send_BIGRRQ(const char *fileName, int sockfd, struct sockaddr_in addr, int blksize, int windowsize) {
     socklen_t addr_size = sizeof(struct sockaddr_in);
-    addr_size = sizeof(addr);
-    char buffer[SIZE];
-    int n, retries;
+    char *buffer;
+    int n, retries = 0, retransmits = 0;
+    RttEstimator rtt;
+    
+    rttInit(&rtt);
     
     
     FILE *fp = fopen(fileName, "w+");
@@ -259,125 +454,162 @@ void send_BIGRRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
     if (fp == NULL)
         dieWithError("[ERROR] Could not open file for writing");
     
+    /* The server may lower blksize but never raise it, so the requested size bounds every packet. */
+    int bufferSize = 4 + blksize > SIZE ? 4 + blksize : SIZE;
+    buffer = calloc(1, bufferSize);
+    if (buffer == NULL)
+        dieWithError("[ERROR] malloc error");
     
-    struct timeval tv;
-    tv.tv_sec = TIMEOUT;
-    tv.tv_usec = 0;
-    
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv) < 0)
-        dieWithError("[ERROR] setsockopt failed");
     
+    setReceiveTimeout(sockfd, RTO_GIVE_UP_US);
     
-    memset(buffer, 0, SIZE);
-    buffer[1] = 1;
-    strcpy(buffer + 2, fileName);
-    strcpy(buffer + 2 + strlen(fileName) + 1, "octet");
-    strcpy(buffer + 2 + strlen(fileName) + 1 + strlen("octet") + 1, "bigfile");
     
-    int packetLength = 2 + strlen(fileName) + 1 + strlen("octet") + 1 + strlen("bigfile");
+    int packetLength = buildOptionRequest(buffer, bufferSize, OP_RRQ, fileName, blksize, windowsize, 0);
     
     
+    long long sentAt = monotonicUs();
+    long long requestedAt = sentAt;
     n = sendto(sockfd, buffer, packetLength, 0, (struct sockaddr *)&addr, sizeof(addr));
     if (n < 0)
         dieWithError("[ERROR] sending RRQ to the server.");
     else if (n == 0) {
-        printf("[INFO] No data sent to server.\n");
+        LOG(LOG_INFO, "event=request_not_sent op=rrq");
     }
     else {
-        printf("[INFO] RRQ sent successfully.\n");
+        LOG(LOG_INFO, "event=request_sent op=rrq");
     }
     
     
-    memset(buffer, 0, SIZE);
-    
-    char ackPacket[4];
-    ackPacket[0] = 0;
-    ackPacket[1] = 4;
-    ackPacket[2] = 0;
-    ackPacket[3] = 0;
-    packetLength = 4;
-    
-    n = recvfrom(sockfd, buffer, SIZE, 0, (struct sockaddr *) &addr, &addr_size);
-    
-    
-    if (n < 0) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            if (retries == MAX_RETRIES) {
-                dieWithError("[ERROR] recvfrom error after max retries");
-            }
-            printf("[RETRY] Retrying recvfrom...\n");
-            retries++;
-        }
-        else {
-            dieWithError("[ERROR] recvfrom error");
-        }
-    }
+    n = recvfrom(sockfd, buffer, bufferSize, 0, (struct sockaddr *) &addr, &addr_size);
+    if (n < 0)
+        dieWithError("[ERROR] recvfrom error");
     
-    if(buffer[1] == 6){
-        sendto(sockfd, ackPacket, packetLength, 0, (struct sockaddr *) &addr, sizeof(addr));
-    }
-    else{
+    if (buffer[1] != 6)
         dieWithError("[ERROR] : Server hasn't accepted the option.");
-    }
+    
+    long long tsize;
+    int bigfile;
+    if (parseOack(buffer, n, &blksize, &windowsize, &tsize, &bigfile) < 0)
+        dieWithError("[ERROR] Server answered with invalid options");
+    LOG(LOG_INFO, "event=negotiated blksize=%d windowsize=%d", blksize, windowsize);
+    rttSample(&rtt, monotonicUs() - sentAt);
+    
+    WriteBehind writer;
+    char *writeBuffer = aligned_alloc(WRITE_BEHIND_ALIGN, writeBehindCapacity(tsize));
+    if (writeBuffer == NULL)
+        dieWithError("[ERROR] malloc error");
+    writeBehindInit(&writer, fileno(fp), writeBuffer, writeBehindCapacity(tsize), tsize);
+    
+    size_t wanted = (size_t)windowsize * (4 + blksize) * 2;
+    int rcvbuf = wanted > INT_MAX ? INT_MAX : (int)wanted, current;
+    socklen_t len = sizeof(current);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &current, &len) == 0 && current < rcvbuf)
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    sendAckPacket(sockfd, &addr, 0);
+    
+    /* RFC 7440 receiver: ACK the last block of each window and the final block.
+       On a gap, ACK the last in-order block once so the sender restarts from
+       there; a duplicate means our last ACK was lost and is answered again.
+       The RTT is timed from a new ACK to the block that follows it. */
+    long long expected = 1;
+    int sinceAck = 0, gapAcked = 0;
+    long long timedBlock = 1, timedAt = monotonicUs();
     
     while (1) {
-        retries = 0;
+        setReceiveTimeout(sockfd, rtt.rto);
+        n = recvfrom(sockfd, buffer, bufferSize, 0, (struct sockaddr *) &addr, &addr_size);
         
-        while (retries < MAX_RETRIES) {
-            
-            n = recvfrom(sockfd, buffer, SIZE, 0, (struct sockaddr *) &addr, &addr_size);
-            
-            
-            if (n < 0) {
-                if (errno == EWOULDBLOCK || errno == EAGAIN) {
-                    if (retries == MAX_RETRIES) {
-                        dieWithError("[ERROR] recvfrom error after max retries");
-                    }
-                    printf("[RETRY] Retrying recvfrom...\n");
-                    retries++;
-                    continue;
-                }
-                else {
-                    dieWithError("[ERROR] recvfrom error");
+        if (n < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                rttBackoff(&rtt);
+                if (rttExpired(&rtt, ++retries, MAX_RETRIES)) {
+                    writeBehindRelease(&writer);
+                    fclose(fp);
+                    dieWithError("[ERROR] recvfrom error after max retries");
                 }
+                LOG(LOG_INFO, "event=ack_resent block=%d", wireBlock(expected - 1, bigfile));
+                sendAckPacket(sockfd, &addr, wireBlock(expected - 1, bigfile));
+                retransmits++;
+                timedBlock = -1;
+                sinceAck = 0;
+                continue;
             }
-            
-            
-            if (buffer[1] == 3) {
-                
-                if (fwrite(buffer + 4, 1, n - 4, fp) < 1)
-                    dieWithError("[ERROR] fwrite error");
-                
-                
-                ackPacket[2] = buffer[2];
-                ackPacket[3] = buffer[3];
-                
-                if (sendto(sockfd, ackPacket, sizeof(ackPacket), 0, (struct sockaddr *) &addr, addr_size) < 0)
-                    dieWithError("[ERROR] sendto error");
-                
-                break;
-            }
-            
-            else if (buffer[1]==5){
-                printf("[ERROR] Received error packet from server: %s\n", buffer + 4);
-                fclose(fp);
-                exit(EXIT_FAILURE);
-            }
+            dieWithError("[ERROR] recvfrom error");
         }
         
+        if (n >= 4 && buffer[1] == 5) {
+            LOG(LOG_ERROR, "event=server_error message=\"%.*s\"", n - 4, buffer + 4);
+            writeBehindRelease(&writer);
+            fclose(fp);
+            exit(EXIT_FAILURE);
+        }
         
-        if (n < 512) {
-            if (retries == MAX_RETRIES){
-                printf("[ERROR] Max retries attempt. File cannot be received");
-            }
-            else {
-                printf("[SUCCESS] File received successfully.\n");
+        if (n >= 4 && buffer[1] == 6 && expected == 1) {
+            sendAckPacket(sockfd, &addr, 0);
+            retransmits++;
+            timedBlock = -1;
+            continue;
+        }
+        
+        if (n < 4 || buffer[1] != 3)
+            continue;
+        
+        int blockNumber = (unsigned char) buffer[2] << 8 | (unsigned char) buffer[3];
+        if (blockNumber != wireBlock(expected, bigfile)) {
+            if (blockIndex(blockNumber, expected - windowsize, expected - 1, bigfile) >= 0) {
+                sendAckPacket(sockfd, &addr, wireBlock(expected - 1, bigfile));
+                retransmits++;
+                timedBlock = -1;
+                sinceAck = 0;
+            } else if (!gapAcked) {
+                sendAckPacket(sockfd, &addr, wireBlock(expected - 1, bigfile));
+                retransmits++;
+                timedBlock = -1;
+                sinceAck = 0;
+                gapAcked = 1;
             }
-            
-            fclose(fp);
+            continue;
+        }
+        
+        if (n > 4 && writeBehindAppend(&writer, buffer + 4, n - 4) < 0)
+            dieWithError("[ERROR] write error");
+        if (timedBlock == expected) {
+            rttSample(&rtt, monotonicUs() - timedAt);
+            histogramRecord(&client_latency.blockRtt, monotonicUs() - timedAt);
+            timedBlock = -1;
+        }
+        if (expected == 1)
+            histogramRecord(&client_latency.setup, monotonicUs() - requestedAt);
+        expected++;
+        sinceAck++;
+        gapAcked = 0;
+        retries = 0;
+        rttProgress(&rtt);
+        
+        if (n - 4 < blksize) {
+            if (writeBehindFlush(&writer) < 0)
+                dieWithError("[ERROR] write error");
+            sendAckPacket(sockfd, &addr, wireBlock(expected - 1, bigfile));
+            histogramRecord(&client_latency.transfer, monotonicUs() - requestedAt);
+            LOG(LOG_INFO, "event=transfer_done op=rrq");
+            printTransferStats(&rtt, expected - 1, retransmits);
             break;
         }
+        
+        if (sinceAck >= windowsize) {
+            sendAckPacket(sockfd, &addr, wireBlock(expected - 1, bigfile));
+            sinceAck = 0;
+            if (timedBlock < 0) {
+                timedBlock = expected;
+                timedAt = monotonicUs();
+            }
+        }
     }
+    
+    writeBehindRelease(&writer);
+    free(writeBuffer);
+    fclose(fp);
+    free(buffer);
 }
 
 
@@ -386,7 +618,10 @@ void send_RRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
     socklen_t addr_size = sizeof(struct sockaddr_in);
     addr_size = sizeof(addr);
     char buffer[SIZE];
-    int n, retries;
+    int n, retries, retransmits = 0;
+    RttEstimator rtt;
+    
+    rttInit(&rtt);
     
     
     FILE *fp = fopen(fileName, "w+");
@@ -394,32 +629,25 @@ void send_RRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
     if (fp == NULL)
         dieWithError("[ERROR] Could not open file for writing");
     
+    WriteBehind writer;
+    char *writeBuffer = aligned_alloc(WRITE_BEHIND_ALIGN, WRITE_BEHIND_SIZE);
+    if (writeBuffer == NULL)
+        dieWithError("[ERROR] malloc error");
+    writeBehindInit(&writer, fileno(fp), writeBuffer, WRITE_BEHIND_SIZE, -1);
     
-    struct timeval tv;
-    tv.tv_sec = TIMEOUT;
-    tv.tv_usec = 0;
-    
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv) < 0)
-        dieWithError("[ERROR] setsockopt failed");
-    
-    
-    memset(buffer, 0, SIZE);
-    buffer[1] = 1;
-    strcpy(buffer + 2, fileName);
-    strcpy(buffer + 2 + strlen(fileName) + 1, "octet");
-    
-    
-    int packetLength = 2 + strlen(fileName) + 1 + strlen("octet") + 1;
+    int packetLength = buildRequest(buffer, SIZE, OP_RRQ, fileName);
     
     
+    long long sentAt = monotonicUs();
+    long long requestedAt = sentAt;
     n = sendto(sockfd, buffer, packetLength, 0, (struct sockaddr *) &addr, sizeof(addr));
     if (n < 0)
         dieWithError("[ERROR] sending RRQ to the server.");
     else if (n == 0) {
-        printf("[INFO] No data sent to server.\n");
+        LOG(LOG_INFO, "event=request_not_sent op=rrq");
     }
     else {
-        printf("[INFO] RRQ sent successfully.\n");
+        LOG(LOG_INFO, "event=request_sent op=rrq");
     }
     
     
@@ -431,23 +659,34 @@ void send_RRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
     ackPacket[2] = 0;
     ackPacket[3] = 0;
     
-    
+    /* The server retransmits on timeout: a block we already have is only
+       acknowledged again. Each block is timed from the ACK before it, unless
+       that ACK had to be sent twice (Karn). */
+    int expectedBlock = 1, timed = 1;
+    long long received = 0;
     
     while (1) {
         retries = 0;
         
-        while (retries < MAX_RETRIES) {
+        while (1) {
             
+            /* Before the first block there is nothing to acknowledge: wait for
+               the server to answer the RRQ. */
+            setReceiveTimeout(sockfd, expectedBlock == 1 ? RTO_GIVE_UP_US : rtt.rto);
             n = recvfrom(sockfd, buffer, SIZE, 0, (struct sockaddr *) &addr, &addr_size);
             
             
             if (n < 0) {
                 if (errno == EWOULDBLOCK || errno == EAGAIN) {
-                    if (retries == MAX_RETRIES) {
+                    rttBackoff(&rtt);
+                    if (expectedBlock == 1 || rttExpired(&rtt, ++retries, MAX_RETRIES)) {
+                        fclose(fp);
                         dieWithError("[ERROR] recvfrom error after max retries");
                     }
-                    printf("[RETRY] Retrying recvfrom...\n");
-                    retries++;
+                    LOG(LOG_INFO, "event=ack_resent block=%d", (unsigned char) ackPacket[2] << 8 | (unsigned char) ackPacket[3]);
+                    sendto(sockfd, ackPacket, sizeof(ackPacket), 0, (struct sockaddr *) &addr, addr_size);
+                    retransmits++;
+                    timed = 0;
                     continue;
                 }
                 else {
@@ -456,37 +695,57 @@ void send_RRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
             }
             
             
-            if (buffer[1] == 3) {
+            if (n >= 4 && buffer[1] == 3) {
+                int blockNumber = (unsigned char) buffer[2] << 8 | (unsigned char) buffer[3];
                 
-                if (fwrite(buffer + 4, 1, n - 4, fp) < 1)
-                    dieWithError("[ERROR] fwrite error");
+                if (blockNumber != expectedBlock) {
+                    char duplicateAck[4] = { 0, 4, buffer[2], buffer[3] };
+                    sendto(sockfd, duplicateAck, sizeof(duplicateAck), 0, (struct sockaddr *) &addr, addr_size);
+                    continue;
+                }
+                
+                if (n > 4 && writeBehindAppend(&writer, buffer + 4, n - 4) < 0)
+                    dieWithError("[ERROR] write error");
+                if (n < SIZE && writeBehindFlush(&writer) < 0)
+                    dieWithError("[ERROR] write error");
+                /* The first block answers the RRQ itself: it times the setup. */
+                if (timed)
+                    rttSample(&rtt, monotonicUs() - sentAt);
+                if (received == 0)
+                    histogramRecord(&client_latency.setup, monotonicUs() - requestedAt);
+                else if (timed)
+                    histogramRecord(&client_latency.blockRtt, monotonicUs() - sentAt);
+                rttProgress(&rtt);
+                expectedBlock = (expectedBlock + 1) & 0xFFFF;
+                received++;
                 
                 
                 ackPacket[2] = buffer[2];
                 ackPacket[3] = buffer[3];
                 
+                sentAt = monotonicUs();
+                timed = 1;
                 if (sendto(sockfd, ackPacket, sizeof(ackPacket), 0, (struct sockaddr *) &addr, addr_size) < 0)
                     dieWithError("[ERROR] sendto error");
                 
                 break;
             }
             
-            else if (buffer[1]==5){
-                printf("[ERROR] Received error packet from server: %s\n", buffer + 4);
+            else if (n >= 4 && buffer[1]==5){
+                buffer[n < SIZE ? n : SIZE - 1] = 0;
+                LOG(LOG_ERROR, "event=server_error message=\"%s\"", buffer + 4);
                 fclose(fp);
                 exit(EXIT_FAILURE);
             }
         }
         
         
-        if (n < 512) {
-            if (retries == MAX_RETRIES){
-                printf("[ERROR] Max retries attempt. File cannot be received");
-            }
-            else {
-                printf("[SUCCESS] File received successfully.\n");
-            }
+        if (n < 516) {
+            histogramRecord(&client_latency.transfer, monotonicUs() - requestedAt);
+            LOG(LOG_INFO, "event=transfer_done op=rrq");
+            printTransferStats(&rtt, received, retransmits);
             
+            free(writeBuffer);
             fclose(fp);
             break;
         }
@@ -496,7 +755,7 @@ void send_RRQ(const char *fileName, int sockfd, struct sockaddr_in addr) {
 
 int main(int argc, char* argv[]) {
     char ip[15], filename[256], request[4], option[50];
-    int port;
+    int port, blksize = DEFAULT_BLKSIZE, windowsize = DEFAULT_WINDOWSIZE;
     
     
     
@@ -514,6 +773,20 @@ int main(int argc, char* argv[]) {
     strcpy(filename, argv[2]);
     if (argc > 3) {
         strcpy(option, argv[3]);
+        if (argc > 4) {
+            blksize = atoi(argv[4]);
+            if (blksize < PACKET_MIN_BLKSIZE || blksize > MAX_BLKSIZE) {
+                printf("[ERROR] blksize must be between %d and %d\n", PACKET_MIN_BLKSIZE, MAX_BLKSIZE);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (argc > 5) {
+            windowsize = atoi(argv[5]);
+            if (windowsize < 1 || windowsize > MAX_WINDOWSIZE) {
+                printf("[ERROR] windowsize must be between 1 and %d\n", MAX_WINDOWSIZE);
+                exit(EXIT_FAILURE);
+            }
+        }
     } else {
         
         
@@ -522,6 +795,16 @@ int main(int argc, char* argv[]) {
         
     }
     
+    /* TFTP_LOG=debug/100 shows one per-block line in 100. */
+    const char *logSpec = getenv("TFTP_LOG");
+    if (logSpec != NULL && logConfigure(logSpec) < 0) {
+        printf("[ERROR] TFTP_LOG must be error, warning, info or debug, optionally followed by /sample_every\n");
+        exit(EXIT_FAILURE);
+    }
+    atexit(printClientLatency);
+    logStart();
+    bufferPoolInit(&client_buffers);
+    
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     struct sockaddr_in server_addr;
     
@@ -538,7 +821,7 @@ int main(int argc, char* argv[]) {
     if (strcmp("put", request) == 0) {
         if (argc > 3) {
             if (strcmp("bigfile", option) == 0) {
-                send_BIGWRQ(filename, sockfd, server_addr);
+                send_BIGWRQ(filename, sockfd, server_addr, blksize, windowsize);
             }
         }
         else {
@@ -549,7 +832,7 @@ int main(int argc, char* argv[]) {
     else if (strcmp("get", request) == 0) {
         if (argc > 3) {
             if (strcmp("bigfile", option) == 0) {
-                send_BIGRRQ(filename, sockfd, server_addr);
+                send_BIGRRQ(filename, sockfd, server_addr, blksize, windowsize);
             }
         }else{
             
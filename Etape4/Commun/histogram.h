@@ -0,0 +1,133 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+/* Latency histogram with log-linear buckets, as in HdrHistogram. Values below
+   16 get one bucket each, and every power of two above that is split into
+   16 buckets. A bucket is therefore never wider than 1/16 of its values
+   (about 6 %), and everything up to 2^36 us (19 hours) fits in 528 fixed
+   counters. Only the owning thread records, with a relaxed load and store.
+   Any thread can merge or read. Values are in microseconds. */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef _Atomic unsigned long HistogramCounter;
+
+typedef struct {
+    HistogramCounter counts[HISTOGRAM_BUCKETS];
+    HistogramCounter sum;
+    HistogramCounter max;
+} Histogram;
+
+/* What both ends record for every transfer. Setup runs from the request to
+   the first block acknowledged (sender) or received (receiver). */
+typedef struct {
+    Histogram setup;
+    Histogram blockRtt;
+    Histogram transfer;
+} TransferLatency;
+
+static inline void histogramAdd(HistogramCounter *counter, unsigned long n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline unsigned long histogramRead(HistogramCounter *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static inline int histogramIndex(long long value) {
+    if (value < 0)
+        value = 0;
+    if (value >= 1LL << HISTOGRAM_MAX_BITS)
+        value = (1LL << HISTOGRAM_MAX_BITS) - 1;
+    if (value < HISTOGRAM_SUB_COUNT)
+        return (int)value;
+    int magnitude = 63 - __builtin_clzll(value);
+    return (magnitude - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT
+        + (int)(value >> (magnitude - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_COUNT;
+}
+
+/* Highest value that falls in a bucket. */
+static inline long long histogramBucketTop(int index) {
+    if (index < HISTOGRAM_SUB_COUNT)
+        return index;
+    int shift = index / HISTOGRAM_SUB_COUNT - 1;
+    long long sub = index % HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+static inline void histogramRecord(Histogram *histogram, long long value) {
+    if (value < 0)
+        value = 0;
+    histogramAdd(&histogram->counts[histogramIndex(value)], 1);
+    histogramAdd(&histogram->sum, value);
+    if ((unsigned long)value > histogramRead(&histogram->max))
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+}
+
+/* Adds src to into; nothing may record into "into" meanwhile. */
+static inline void histogramMerge(Histogram *into, Histogram *src) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        histogramAdd(&into->counts[i], histogramRead(&src->counts[i]));
+    histogramAdd(&into->sum, histogramRead(&src->sum));
+    if (histogramRead(&src->max) > histogramRead(&into->max))
+        atomic_store_explicit(&into->max, histogramRead(&src->max), memory_order_relaxed);
+}
+
+static inline void transferLatencyMerge(TransferLatency *into, TransferLatency *src) {
+    histogramMerge(&into->setup, &src->setup);
+    histogramMerge(&into->blockRtt, &src->blockRtt);
+    histogramMerge(&into->transfer, &src->transfer);
+}
+
+static inline unsigned long histogramCount(Histogram *histogram) {
+    unsigned long count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        count += histogramRead(&histogram->counts[i]);
+    return count;
+}
+
+/* Upper bound of the bucket holding the q-quantile, capped by the largest
+   value seen; 0 without samples. */
+static inline long long histogramPercentile(Histogram *histogram, double q) {
+    unsigned long count = histogramCount(histogram);
+    unsigned long rank = (unsigned long)(q * count + 0.999999);
+    unsigned long seen = 0;
+    long long max = histogramRead(&histogram->max);
+
+    if (rank == 0)
+        rank = 1;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogramRead(&histogram->counts[i]);
+        if (seen >= rank) {
+            long long top = histogramBucketTop(i);
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+static inline void printHistogram(FILE *out, const char *label, Histogram *histogram) {
+    unsigned long count = histogramCount(histogram);
+
+    if (count == 0) {
+        fprintf(out, "[LATENCY] %-19s no samples\n", label);
+        return;
+    }
+    fprintf(out, "[LATENCY] %-19s %lu samples, mean %.3f ms, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n",
+            label, count, histogramRead(&histogram->sum) / 1000.0 / count, histogramPercentile(histogram, 0.5) / 1000.0,
+            histogramPercentile(histogram, 0.9) / 1000.0, histogramPercentile(histogram, 0.99) / 1000.0,
+            histogramPercentile(histogram, 0.999) / 1000.0, histogramRead(&histogram->max) / 1000.0);
+}
+
+static inline void printTransferLatency(FILE *out, TransferLatency *latency) {
+    printHistogram(out, "time to first block", &latency->setup);
+    printHistogram(out, "block RTT", &latency->blockRtt);
+    printHistogram(out, "transfer", &latency->transfer);
+}
+
+#endif
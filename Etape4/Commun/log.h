@@ -0,0 +1,229 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Asynchronous logger. A LOG() call formats its line straight into a slot of a
+   lock-free ring (bounded MPMC queue with one sequence number per slot) and
+   returns: no lock, no syscall. A slot's sequence counts in laps of the ring
+   (lap start: free, lap start + 1: written), so a zeroed ring is ready. A
+   background thread drains the ring into stdout and flushes once per batch.
+   It sleeps on a condition variable only once the ring is empty, and only
+   the line that finds it asleep pays for the wakeup. When the ring is full
+   the line is dropped and counted, so a slow terminal or journald pipe slows
+   the log down, never the transfer.
+
+   Each line has a level. Lines above log_level cost one branch and are not
+   formatted. Per-block events are LOG_DEBUG, off by default, and go through
+   LOG_SAMPLED, which keeps one call in log_sample per call site and thread.
+
+   A line is a record of key=value fields: ts (Unix time in seconds, to the
+   microsecond) and level are added here; callers give event first, then its
+   own fields, with peer=ip:port naming the session on the server. Control
+   characters in the fields become '?', so a file name cannot forge a record. */
+#define LOG_ERROR 0
+#define LOG_WARNING 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#define LOG_RING_SIZE 4096
+#define LOG_LINE_SIZE 240
+
+typedef struct {
+    _Atomic size_t sequence;
+    int len;
+    char text[LOG_LINE_SIZE];
+} LogSlot;
+
+typedef struct {
+    LogSlot slots[LOG_RING_SIZE];
+    _Atomic size_t tail __attribute__((aligned(64)));
+    size_t head __attribute__((aligned(64)));
+    _Atomic unsigned long dropped;
+    _Atomic int running;
+    _Atomic int sleeping;
+    int started;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+} LogRing;
+
+static int log_level = LOG_INFO;
+static unsigned long log_sample = 1;
+static LogRing log_ring;
+
+static const char *const log_level_names[] = { "error", "warning", "info", "debug" };
+
+#define LOG(level, ...) do { \
+    if ((level) <= log_level) \
+        logWrite((level), __VA_ARGS__); \
+} while (0)
+
+#define LOG_SAMPLED(level, ...) do { \
+    if ((level) <= log_level) { \
+        static __thread unsigned long logSeen; \
+        if (logSeen++ % log_sample == 0) \
+            logWrite((level), __VA_ARGS__); \
+    } \
+} while (0)
+
+static inline int logPrefix(char *text, int size, int level) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return snprintf(text, size, "ts=%lld.%06ld level=%s ", (long long)now.tv_sec, now.tv_nsec / 1000, log_level_names[level]);
+}
+
+static inline void logWrite(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static inline void logWrite(int level, const char *format, ...) {
+    LogRing *ring = &log_ring;
+    size_t position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    LogSlot *slot;
+    va_list args;
+
+    for (;;) {
+        slot = &ring->slots[position & (LOG_RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        long diff = (long)(sequence - (position & ~(size_t)(LOG_RING_SIZE - 1)));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    int prefix = logPrefix(slot->text, LOG_LINE_SIZE, level);
+    va_start(args, format);
+    int len = vsnprintf(slot->text + prefix, LOG_LINE_SIZE - prefix, format, args);
+    va_end(args);
+    len = len < 0 ? prefix : prefix + len;
+    if (len > LOG_LINE_SIZE - 2)
+        len = LOG_LINE_SIZE - 2;
+    for (int i = prefix; i < len; i++) {
+        if ((unsigned char)slot->text[i] < 0x20 || slot->text[i] == 0x7f)
+            slot->text[i] = '?';
+    }
+    slot->text[len++] = '\n';
+    slot->len = len;
+    atomic_store_explicit(&slot->sequence, (position & ~(size_t)(LOG_RING_SIZE - 1)) + 1, memory_order_release);
+
+    /* Pairs with the fence in logThread(): either the drain thread sees this
+       line before it sleeps, or this line sees it asleep. */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->sleeping, memory_order_relaxed)) {
+        pthread_mutex_lock(&ring->mutex);
+        pthread_cond_signal(&ring->notEmpty);
+        pthread_mutex_unlock(&ring->mutex);
+    }
+}
+
+/* Writes every published line to out; returns how many there were. Only the
+   drain thread, or the caller of logStop() once it has stopped, calls it. */
+static inline int logDrain(FILE *out) {
+    LogRing *ring = &log_ring;
+    int count = 0;
+
+    for (;;) {
+        LogSlot *slot = &ring->slots[ring->head & (LOG_RING_SIZE - 1)];
+        size_t lap = ring->head & ~(size_t)(LOG_RING_SIZE - 1);
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != lap + 1)
+            break;
+        fwrite(slot->text, 1, slot->len, out);
+        atomic_store_explicit(&slot->sequence, lap + LOG_RING_SIZE, memory_order_release);
+        ring->head++;
+        count++;
+    }
+
+    unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        char prefix[64];
+        logPrefix(prefix, sizeof(prefix), LOG_WARNING);
+        fprintf(out, "%sevent=log_dropped lines=%lu\n", prefix, dropped);
+    }
+    if (count > 0 || dropped > 0)
+        fflush(out);
+    return count;
+}
+
+static inline int logRingEmpty(LogRing *ring) {
+    LogSlot *slot = &ring->slots[ring->head & (LOG_RING_SIZE - 1)];
+    size_t lap = ring->head & ~(size_t)(LOG_RING_SIZE - 1);
+    return atomic_load_explicit(&slot->sequence, memory_order_acquire) != lap + 1;
+}
+
+static inline void *logThread(void *arg) {
+    LogRing *ring = &log_ring;
+    (void)arg;
+
+    while (atomic_load_explicit(&ring->running, memory_order_acquire)) {
+        if (logDrain(stdout) > 0)
+            continue;
+
+        pthread_mutex_lock(&ring->mutex);
+        atomic_store_explicit(&ring->sleeping, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (logRingEmpty(ring) && atomic_load_explicit(&ring->running, memory_order_acquire))
+            pthread_cond_wait(&ring->notEmpty, &ring->mutex);
+        atomic_store_explicit(&ring->sleeping, 0, memory_order_relaxed);
+        pthread_mutex_unlock(&ring->mutex);
+    }
+    return NULL;
+}
+
+/* Until logStart() is called, lines wait in the ring (and are dropped once it
+   is full); logStop() writes out whatever is left. logStart() also registers
+   logStop() with atexit(), so exit() after an error loses no line. */
+static inline void logStop(void);
+
+static inline void logStart(void) {
+    pthread_mutex_init(&log_ring.mutex, NULL);
+    pthread_cond_init(&log_ring.notEmpty, NULL);
+    atomic_store_explicit(&log_ring.running, 1, memory_order_release);
+    log_ring.started = pthread_create(&log_ring.thread, NULL, logThread, NULL) == 0;
+    atexit(logStop);
+}
+
+static inline void logStop(void) {
+    atomic_store_explicit(&log_ring.running, 0, memory_order_release);
+    if (log_ring.started) {
+        pthread_mutex_lock(&log_ring.mutex);
+        pthread_cond_signal(&log_ring.notEmpty);
+        pthread_mutex_unlock(&log_ring.mutex);
+        pthread_join(log_ring.thread, NULL);
+    }
+    log_ring.started = 0;
+    logDrain(stdout);
+}
+
+/* "level" or "level/every", e.g. "debug/100" for one per-block line in 100.
+   Returns -1 if the level is unknown or every is not positive. */
+static inline int logConfigure(const char *spec) {
+    const char *slash = strchr(spec, '/');
+    size_t len = slash != NULL ? (size_t)(slash - spec) : strlen(spec);
+
+    for (int level = LOG_ERROR; level <= LOG_DEBUG; level++) {
+        if (strlen(log_level_names[level]) == len && strncasecmp(spec, log_level_names[level], len) == 0) {
+            long every = slash != NULL ? atol(slash + 1) : 1;
+            if (every < 1)
+                return -1;
+            log_level = level;
+            log_sample = every;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+/* TFTP packet codec shared by the client and the server. Parsing never copies
+   nor writes to the packet: it walks it once and returns views into it. Every
+   string field must end with a NUL inside the packet (RFC 1350), so a view is
+   always followed by a NUL and view.data can be passed to open() as is. */
+#define OP_RRQ 1
+#define OP_WRQ 2
+#define OP_DATA 3
+#define OP_ACK 4
+#define OP_ERROR 5
+#define OP_OACK 6
+
+/* Options past this count are ignored; RFC 2347 requests carry a handful. */
+#define PACKET_MAX_OPTIONS 16
+
+typedef struct {
+    const char *data;
+    size_t len;
+} StrView;
+
+typedef struct {
+    StrView name;
+    StrView value;
+} PacketOption;
+
+typedef struct {
+    int opcode;
+    StrView filename;
+    StrView mode;
+    int optionCount;
+    PacketOption options[PACKET_MAX_OPTIONS];
+} RequestPacket;
+
+static inline int packetOpcode(const char *packet, size_t n) {
+    if (n < 2)
+        return -1;
+    return (unsigned char)packet[0] << 8 | (unsigned char)packet[1];
+}
+
+/* Takes the NUL-terminated string at *cursor, or fails if the packet ends first. */
+static inline int nextString(const char **cursor, const char *end, StrView *view) {
+    const char *nul = memchr(*cursor, 0, end - *cursor);
+    if (nul == NULL)
+        return -1;
+    view->data = *cursor;
+    view->len = nul - *cursor;
+    *cursor = nul + 1;
+    return 0;
+}
+
+/* Reads "name\0value\0" pairs up to end. Returns the number of options kept,
+   or -1 if a name or a value is not terminated. */
+static inline int parseOptionList(const char *cursor, const char *end, PacketOption *options, int maxOptions) {
+    int count = 0;
+
+    while (cursor < end) {
+        PacketOption option;
+        if (nextString(&cursor, end, &option.name) < 0 || nextString(&cursor, end, &option.value) < 0)
+            return -1;
+        if (count < maxOptions)
+            options[count++] = option;
+    }
+    return count;
+}
+
+/* RRQ/WRQ: opcode, filename, mode and options. Returns -1 if the packet is not
+   a request, the filename is empty or a field runs past the end. */
+static inline int parseRequest(const char *packet, size_t n, RequestPacket *request) {
+    const char *end = packet + n;
+    const char *cursor = packet + 2;
+
+    request->opcode = packetOpcode(packet, n);
+    if (request->opcode != OP_RRQ && request->opcode != OP_WRQ)
+        return -1;
+    if (nextString(&cursor, end, &request->filename) < 0 || request->filename.len == 0)
+        return -1;
+    if (nextString(&cursor, end, &request->mode) < 0)
+        return -1;
+    request->optionCount = parseOptionList(cursor, end, request->options, PACKET_MAX_OPTIONS);
+    return request->optionCount < 0 ? -1 : 0;
+}
+
+/* OACK: the options after the opcode. */
+static inline int parseOackPacket(const char *packet, size_t n, PacketOption *options, int maxOptions) {
+    if (packetOpcode(packet, n) != OP_OACK)
+        return -1;
+    return parseOptionList(packet + 2, packet + n, options, maxOptions);
+}
+
+/* Option names are case-insensitive (RFC 2347). */
+static inline int viewIs(StrView view, const char *name) {
+    size_t len = strlen(name);
+    return view.len == len && strncasecmp(view.data, name, len) == 0;
+}
+
+/* Decimal value of an option; -1 if it is empty, not a number or too large. */
+static inline long long viewToNumber(StrView view) {
+    long long value = 0;
+
+    if (view.len == 0 || view.len > 18)
+        return -1;
+    for (size_t i = 0; i < view.len; i++) {
+        if (view.data[i] < '0' || view.data[i] > '9')
+            return -1;
+        value = value * 10 + (view.data[i] - '0');
+    }
+    return value;
+}
+
+/* Smallest blksize RFC 2348 allows. */
+#define PACKET_MIN_BLKSIZE 8
+
+/* Reads the options a server accepted in an OACK. On entry blksize and
+   windowsize hold what was requested, which the server may only lower; options
+   left out fall back to the RFC 1350 values, anything else rejects the OACK.
+   tsize is -1 and bigfile 0 if the server left them out. */
+static inline int parseOack(const char *packet, size_t n, int *blksize, int *windowsize, long long *tsize, int *bigfile) {
+    PacketOption options[PACKET_MAX_OPTIONS];
+    long long acceptedBlksize = 512, acceptedWindowsize = 1;
+    *tsize = -1;
+    *bigfile = 0;
+
+    int count = parseOackPacket(packet, n, options, PACKET_MAX_OPTIONS);
+    if (count < 0)
+        return -1;
+    for (int i = 0; i < count; i++) {
+        if (viewIs(options[i].name, "blksize"))
+            acceptedBlksize = viewToNumber(options[i].value);
+        else if (viewIs(options[i].name, "windowsize"))
+            acceptedWindowsize = viewToNumber(options[i].value);
+        else if (viewIs(options[i].name, "tsize"))
+            *tsize = viewToNumber(options[i].value);
+        else if (viewIs(options[i].name, "bigfile"))
+            *bigfile = 1;
+    }
+
+    if (acceptedBlksize < PACKET_MIN_BLKSIZE || acceptedBlksize > *blksize)
+        return -1;
+    if (acceptedWindowsize < 1 || acceptedWindowsize > *windowsize)
+        return -1;
+    *blksize = acceptedBlksize;
+    *windowsize = acceptedWindowsize;
+    return 0;
+}
+
+/* Transfers track absolute block indexes (1, 2, ...) and only fold them into
+   the 16-bit wire number when a packet is built. Block numbers roll over to 0
+   after 65535, or to 1 after BIGFILE_MAX_BLOCK when the bigfile option is in
+   use. Block 0 is only ever the OACK's ACK. */
+#define BIGFILE_MAX_BLOCK 65355
+
+static inline int wireBlock(long long index, int bigfile) {
+    if (index <= 0)
+        return 0;
+    if (bigfile)
+        return (int)((index - 1) % BIGFILE_MAX_BLOCK) + 1;
+    return (int)(index & 0xFFFF);
+}
+
+/* Finds the absolute index of a wire block number in [first, last], or -1. */
+static inline long long blockIndex(int block, long long first, long long last, int bigfile) {
+    long long modulo = bigfile ? BIGFILE_MAX_BLOCK : 65536;
+    long long start = first > 1 ? first : 1;
+
+    if (block == 0 && first <= 0 && last >= 0)
+        return 0;
+    if (bigfile && block == 0)
+        return -1;
+
+    long long position = bigfile ? block - 1 : block;
+    long long startPosition = bigfile ? (start - 1) % modulo : start % modulo;
+    long long index = start + (position - startPosition + modulo) % modulo;
+    return index <= last ? index : -1;
+}
+
+/* Encoding: each function appends to packet[offset..capacity) and returns the
+   new length, or -1 if it does not fit. A -1 offset is passed through, so
+   calls can be chained and checked once at the end. */
+static inline int packString(char *packet, int capacity, int offset, const char *string) {
+    if (offset < 0)
+        return -1;
+    size_t len = strlen(string) + 1;
+    if (len > (size_t)(capacity - offset))
+        return -1;
+    memcpy(packet + offset, string, len);
+    return offset + (int)len;
+}
+
+static inline int packOption(char *packet, int capacity, int offset, const char *name, long long value) {
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%lld", value);
+    return packString(packet, capacity, packString(packet, capacity, offset, name), digits);
+}
+
+static inline int packOpcode(char *packet, int capacity, int opcode) {
+    if (capacity < 2)
+        return -1;
+    packet[0] = (char)(opcode >> 8);
+    packet[1] = (char)opcode;
+    return 2;
+}
+
+/* RRQ/WRQ without options, in octet mode. */
+static inline int packRequest(char *packet, int capacity, int opcode, const char *filename) {
+    int offset = packOpcode(packet, capacity, opcode);
+    return packString(packet, capacity, packString(packet, capacity, offset, filename), "octet");
+}
+
+static inline int packError(char *packet, int capacity, int code, const char *message) {
+    int offset = packOpcode(packet, capacity, OP_ERROR);
+    if (offset < 0 || capacity < 4)
+        return -1;
+    packet[2] = (char)(code >> 8);
+    packet[3] = (char)code;
+    return packString(packet, capacity, 4, message);
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Fixed-size object pool. Objects are carved out of slabs of about
+   POOL_SLAB_BYTES and recycled through a free list; slabs go back to the heap
+   only in poolDestroy(). Not thread-safe: every thread keeps its own pools.
+   slabs counts heap allocations, so once the pool is warm it stops moving
+   while gets keeps growing. */
+#define POOL_SLAB_BYTES (256 * 1024)
+#define POOL_ALIGN 64
+
+typedef struct PoolObject {
+    struct PoolObject *next;
+} PoolObject;
+
+typedef struct PoolSlab {
+    struct PoolSlab *next;
+} PoolSlab;
+
+typedef struct {
+    size_t objectSize;
+    size_t slabObjects;
+    PoolObject *free;
+    PoolSlab *slabList;
+    unsigned long slabs;
+    unsigned long gets;
+    unsigned long inUse;
+    unsigned long peak;
+} Pool;
+
+static inline void poolInit(Pool *pool, size_t objectSize) {
+    memset(pool, 0, sizeof(*pool));
+    if (objectSize < sizeof(PoolObject))
+        objectSize = sizeof(PoolObject);
+    pool->objectSize = (objectSize + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    pool->slabObjects = POOL_SLAB_BYTES / pool->objectSize;
+    if (pool->slabObjects == 0)
+        pool->slabObjects = 1;
+}
+
+/* The slab header takes the first POOL_ALIGN bytes (4096 for page-sized
+   objects, so those stay page-aligned). */
+static inline int poolGrow(Pool *pool) {
+    size_t header = pool->objectSize >= 4096 ? 4096 : POOL_ALIGN;
+    char *slab = aligned_alloc(header, header + pool->slabObjects * pool->objectSize);
+    if (slab == NULL)
+        return -1;
+
+    ((PoolSlab *)slab)->next = pool->slabList;
+    pool->slabList = (PoolSlab *)slab;
+    pool->slabs++;
+    for (size_t i = 0; i < pool->slabObjects; i++) {
+        PoolObject *object = (PoolObject *)(slab + header + i * pool->objectSize);
+        object->next = pool->free;
+        pool->free = object;
+    }
+    return 0;
+}
+
+/* Returns NULL only if the heap is exhausted. The object is not cleared. */
+static inline void *poolGet(Pool *pool) {
+    if (pool->free == NULL && poolGrow(pool) < 0)
+        return NULL;
+
+    PoolObject *object = pool->free;
+    pool->free = object->next;
+    pool->gets++;
+    if (++pool->inUse > pool->peak)
+        pool->peak = pool->inUse;
+    return object;
+}
+
+static inline void poolPut(Pool *pool, void *pointer) {
+    PoolObject *object = pointer;
+    object->next = pool->free;
+    pool->free = object;
+    pool->inUse--;
+}
+
+static inline void poolDestroy(Pool *pool) {
+    while (pool->slabList != NULL) {
+        PoolSlab *slab = pool->slabList;
+        pool->slabList = slab->next;
+        free(slab);
+    }
+    pool->free = NULL;
+}
+
+/* Variable-size buffers: one pool per power-of-two size class, from
+   2^POOL_MIN_SHIFT to 2^POOL_MAX_SHIFT bytes. Larger requests go straight to
+   the heap and are counted in oversize. */
+#define POOL_MIN_SHIFT 6
+#define POOL_MAX_SHIFT 26
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+typedef struct {
+    Pool classes[POOL_CLASSES];
+    unsigned long oversize;
+} BufferPool;
+
+static inline void bufferPoolInit(BufferPool *buffers) {
+    for (int i = 0; i < POOL_CLASSES; i++)
+        poolInit(&buffers->classes[i], (size_t)1 << (POOL_MIN_SHIFT + i));
+    buffers->oversize = 0;
+}
+
+static inline int bufferClass(size_t size) {
+    int shift = POOL_MIN_SHIFT;
+    while (shift <= POOL_MAX_SHIFT && ((size_t)1 << shift) < size)
+        shift++;
+    return shift - POOL_MIN_SHIFT;
+}
+
+/* size must be given again to bufferPut(). */
+static inline void *bufferGet(BufferPool *buffers, size_t size) {
+    int index = bufferClass(size);
+    if (index >= POOL_CLASSES) {
+        buffers->oversize++;
+        return aligned_alloc(4096, (size + 4095) & ~(size_t)4095);
+    }
+    return poolGet(&buffers->classes[index]);
+}
+
+static inline void bufferPut(BufferPool *buffers, void *pointer, size_t size) {
+    int index = bufferClass(size);
+    if (index >= POOL_CLASSES)
+        free(pointer);
+    else
+        poolPut(&buffers->classes[index], pointer);
+}
+
+static inline unsigned long bufferPoolSlabs(BufferPool *buffers) {
+    unsigned long slabs = buffers->oversize;
+    for (int i = 0; i < POOL_CLASSES; i++)
+        slabs += buffers->classes[i].slabs;
+    return slabs;
+}
+
+static inline unsigned long bufferPoolGets(BufferPool *buffers) {
+    unsigned long gets = buffers->oversize;
+    for (int i = 0; i < POOL_CLASSES; i++)
+        gets += buffers->classes[i].gets;
+    return gets;
+}
+
+static inline void bufferPoolDestroy(BufferPool *buffers) {
+    for (int i = 0; i < POOL_CLASSES; i++)
+        poolDestroy(&buffers->classes[i]);
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef RTO_H
+#define RTO_H
+
+#include <time.h>
+
+/* Retransmission timeout per transfer (RFC 6298): SRTT and RTTVAR follow the
+   Jacobson/Karels estimator, every timeout doubles the RTO. Karn's rule is up
+   to the caller: never take a sample on a packet that was sent twice.
+   All times are in microseconds. */
+#define RTO_INITIAL_US 1000000LL
+#define RTO_MIN_US 20000LL
+#define RTO_MAX_US 8000000LL
+#define RTO_GRANULARITY_US 1000LL
+
+/* A transfer is only abandoned after this much silence, however small the RTO. */
+#define RTO_GIVE_UP_US 5000000LL
+
+typedef struct {
+    long long srtt;
+    long long rttvar;
+    long long rto;
+    long long idle;
+    int hasSample;
+} RttEstimator;
+
+static inline long long monotonicUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void rttInit(RttEstimator *rtt) {
+    rtt->srtt = 0;
+    rtt->rttvar = 0;
+    rtt->rto = RTO_INITIAL_US;
+    rtt->idle = 0;
+    rtt->hasSample = 0;
+}
+
+static inline void rttSample(RttEstimator *rtt, long long sample) {
+    if (!rtt->hasSample) {
+        rtt->srtt = sample;
+        rtt->rttvar = sample / 2;
+        rtt->hasSample = 1;
+    } else {
+        long long delta = rtt->srtt > sample ? rtt->srtt - sample : sample - rtt->srtt;
+        rtt->rttvar += (delta - rtt->rttvar) / 4;
+        rtt->srtt += (sample - rtt->srtt) / 8;
+    }
+    
+    long long variance = 4 * rtt->rttvar > RTO_GRANULARITY_US ? 4 * rtt->rttvar : RTO_GRANULARITY_US;
+    rtt->rto = rtt->srtt + variance;
+    if (rtt->rto < RTO_MIN_US)
+        rtt->rto = RTO_MIN_US;
+    if (rtt->rto > RTO_MAX_US)
+        rtt->rto = RTO_MAX_US;
+}
+
+/* The peer answered: the silence counted towards giving up starts over. */
+static inline void rttProgress(RttEstimator *rtt) {
+    rtt->idle = 0;
+}
+
+static inline void rttBackoff(RttEstimator *rtt) {
+    rtt->idle += rtt->rto;
+    rtt->rto = rtt->rto * 2 < RTO_MAX_US ? rtt->rto * 2 : RTO_MAX_US;
+}
+
+static inline int rttExpired(const RttEstimator *rtt, int retries, int maxRetries) {
+    return retries > maxRetries && rtt->idle >= RTO_GIVE_UP_US;
+}
+
+#endif
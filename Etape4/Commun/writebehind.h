@@ -0,0 +1,115 @@
+#ifndef WRITEBEHIND_H
+#define WRITEBEHIND_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+/* Received blocks are gathered in one aligned buffer and written with a single
+   pwrite() whenever it fills up, instead of one fwrite() per DATA packet. An
+   ACK still means "received", exactly as with stdio buffering; only the final
+   ACK waits for everything to be written. Needs _GNU_SOURCE for fallocate(). */
+#define WRITE_BEHIND_SIZE (1 << 20)
+#define WRITE_BEHIND_ALIGN 4096
+#define WRITE_BEHIND_RESERVE_SHARE 4
+
+typedef struct {
+    int fd;
+    int seekable;
+    char *buffer;
+    size_t capacity;
+    size_t used;
+    off_t offset;
+    off_t reserved;
+    unsigned long writes;
+} WriteBehind;
+
+/* Buffer size for a transfer announcing expectedSize bytes (tsize, or -1): a
+   small file only gets a buffer as large as itself. */
+static inline size_t writeBehindCapacity(long long expectedSize) {
+    if (expectedSize >= 0 && expectedSize < WRITE_BEHIND_SIZE)
+        return (expectedSize + WRITE_BEHIND_ALIGN) & ~(size_t)(WRITE_BEHIND_ALIGN - 1);
+    return WRITE_BEHIND_SIZE;
+}
+
+/* The buffer belongs to the caller and must hold capacity bytes. When the size
+   is known the file is reserved up front, without changing its size. The size
+   comes from the peer, so the reservation never exceeds a quarter of the free
+   space: one transfer cannot fill the disk before sending a byte. */
+static inline void writeBehindInit(WriteBehind *writer, int fd, char *buffer, size_t capacity, long long expectedSize) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = fd;
+    writer->buffer = buffer;
+    writer->capacity = capacity;
+    writer->offset = lseek(fd, 0, SEEK_CUR);
+    writer->seekable = writer->offset >= 0;
+    if (!writer->seekable)
+        writer->offset = 0;
+
+    struct statvfs fs;
+    if (expectedSize > 0 && writer->seekable && fstatvfs(fd, &fs) == 0) {
+        long long limit = (long long)(fs.f_bavail / WRITE_BEHIND_RESERVE_SHARE) * fs.f_frsize;
+        if (expectedSize > limit)
+            expectedSize = limit;
+        if (expectedSize > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expectedSize) == 0)
+            writer->reserved = expectedSize;
+    }
+}
+
+/* Gives back the part of the reservation past the end of the file, which a
+   short or aborted transfer would otherwise keep allocated after close. A hole
+   cannot be punched past the end of the file on ext4; truncating the file to
+   its own size frees those blocks without touching the data. */
+static inline void writeBehindRelease(WriteBehind *writer) {
+    struct stat st;
+    if (writer->reserved == 0 || fstat(writer->fd, &st) < 0)
+        return;
+    if (st.st_size < writer->reserved && ftruncate(writer->fd, st.st_size) < 0)
+        return;
+    writer->reserved = 0;
+}
+
+/* Returns -1 with errno set if the data could not be written. */
+static inline int writeBehindFlush(WriteBehind *writer) {
+    size_t done = 0;
+
+    while (done < writer->used) {
+        ssize_t n = writer->seekable
+            ? pwrite(writer->fd, writer->buffer + done, writer->used - done, writer->offset + done)
+            : write(writer->fd, writer->buffer + done, writer->used - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+
+    if (writer->used > 0)
+        writer->writes++;
+    writer->offset += writer->used;
+    writer->used = 0;
+    return 0;
+}
+
+static inline int writeBehindAppend(WriteBehind *writer, const char *data, size_t len) {
+    while (len > 0) {
+        size_t chunk = writer->capacity - writer->used;
+        if (chunk > len)
+            chunk = len;
+        memcpy(writer->buffer + writer->used, data, chunk);
+        writer->used += chunk;
+        data += chunk;
+        len -= chunk;
+
+        if (writer->used == writer->capacity && writeBehindFlush(writer) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+#endif
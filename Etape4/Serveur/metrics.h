@@ -0,0 +1,131 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* Counters of one reactor. Only the reactor writes them, with a relaxed load
+   and store (a plain add, no locked instruction); the metrics endpoint reads
+   every reactor's block and adds them up when it is scraped. Each block has
+   its own cache lines, so reactors never share one. */
+typedef _Atomic unsigned long MetricCounter;
+
+/* Upper bounds of the transfer duration (seconds) and goodput (bytes/s)
+   histogram buckets; a last +Inf bucket catches the rest. */
+#define METRIC_DURATION_BUCKETS 7
+#define METRIC_GOODPUT_BUCKETS 6
+
+static const double metric_duration_bounds[METRIC_DURATION_BUCKETS] = { 0.001, 0.01, 0.1, 1, 10, 60, 600 };
+static const double metric_goodput_bounds[METRIC_GOODPUT_BUCKETS] = { 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+
+typedef struct {
+    MetricCounter packetsIn;
+    MetricCounter packetsOut;
+    MetricCounter bytesIn;
+    MetricCounter bytesOut;
+    MetricCounter retransmits;
+    MetricCounter timeouts;
+    MetricCounter duplicateAcks;
+    MetricCounter errorsSent;
+    MetricCounter sessionsStarted;
+    MetricCounter sessionsCompleted;
+    MetricCounter sessionsFailed;
+    MetricCounter transferBytes;
+    MetricCounter transferMicros;
+    MetricCounter goodputSum;
+    MetricCounter durationBuckets[METRIC_DURATION_BUCKETS + 1];
+    MetricCounter goodputBuckets[METRIC_GOODPUT_BUCKETS + 1];
+} __attribute__((aligned(64))) ServerMetrics;
+
+static inline void metricAdd(MetricCounter *counter, unsigned long n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline unsigned long metricRead(MetricCounter *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static inline int metricBucket(const double *bounds, int count, double value) {
+    int i = 0;
+    while (i < count && value > bounds[i])
+        i++;
+    return i;
+}
+
+/* Called once per transfer, when it ends. */
+static inline void metricsEndSession(ServerMetrics *metrics, int completed, long long micros, long long bytes) {
+    if (!completed) {
+        metricAdd(&metrics->sessionsFailed, 1);
+        return;
+    }
+    double seconds = micros / 1e6;
+    metricAdd(&metrics->sessionsCompleted, 1);
+    metricAdd(&metrics->transferBytes, bytes);
+    metricAdd(&metrics->transferMicros, micros);
+    metricAdd(&metrics->durationBuckets[metricBucket(metric_duration_bounds, METRIC_DURATION_BUCKETS, seconds)], 1);
+    if (micros > 0) {
+        metricAdd(&metrics->goodputBuckets[metricBucket(metric_goodput_bounds, METRIC_GOODPUT_BUCKETS, bytes / seconds)], 1);
+        metricAdd(&metrics->goodputSum, (unsigned long)(bytes / seconds));
+    }
+}
+
+/* Sum of one counter over every reactor; offset is the counter's offsetof(). */
+static inline unsigned long metricSum(ServerMetrics **all, int count, size_t offset) {
+    unsigned long sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += metricRead((MetricCounter *)((char *)all[i] + offset));
+    return sum;
+}
+
+#define METRIC_SUM(all, count, field) metricSum(all, count, offsetof(ServerMetrics, field))
+
+static inline void formatHistogram(FILE *out, const char *name, const char *help, ServerMetrics **all, int count,
+                                   size_t offset, const double *bounds, int bucketCount, double sum) {
+    unsigned long cumulative = 0;
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int b = 0; b <= bucketCount; b++) {
+        cumulative += metricSum(all, count, offset + b * sizeof(MetricCounter));
+        if (b < bucketCount)
+            fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, bounds[b], cumulative);
+        else
+            fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, cumulative);
+    }
+    fprintf(out, "%s_sum %.6f\n%s_count %lu\n", name, sum, name, cumulative);
+}
+
+static inline void formatCounter(FILE *out, const char *name, const char *type, const char *help, unsigned long value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name, value);
+}
+
+/* Prometheus text exposition (format 0.0.4) of the sum over every reactor. */
+static inline void formatMetrics(FILE *out, ServerMetrics **all, int count) {
+    /* Ended transfers are read first, so the active gauge can never go negative. */
+    unsigned long completed = METRIC_SUM(all, count, sessionsCompleted);
+    unsigned long failed = METRIC_SUM(all, count, sessionsFailed);
+    unsigned long started = METRIC_SUM(all, count, sessionsStarted);
+    unsigned long bytes = METRIC_SUM(all, count, transferBytes);
+    double seconds = METRIC_SUM(all, count, transferMicros) / 1e6;
+
+    formatCounter(out, "tftp_packets_received_total", "counter", "Datagrams received.", METRIC_SUM(all, count, packetsIn));
+    formatCounter(out, "tftp_packets_sent_total", "counter", "Datagrams sent.", METRIC_SUM(all, count, packetsOut));
+    formatCounter(out, "tftp_bytes_received_total", "counter", "Bytes received, headers included.", METRIC_SUM(all, count, bytesIn));
+    formatCounter(out, "tftp_bytes_sent_total", "counter", "Bytes sent, headers included.", METRIC_SUM(all, count, bytesOut));
+    formatCounter(out, "tftp_retransmits_total", "counter", "DATA, OACK and ACK packets sent again.", METRIC_SUM(all, count, retransmits));
+    formatCounter(out, "tftp_timeouts_total", "counter", "Retransmission timer expirations.", METRIC_SUM(all, count, timeouts));
+    formatCounter(out, "tftp_duplicate_acks_total", "counter", "ACKs for an already acknowledged block.", METRIC_SUM(all, count, duplicateAcks));
+    formatCounter(out, "tftp_errors_sent_total", "counter", "ERROR packets sent.", METRIC_SUM(all, count, errorsSent));
+    formatCounter(out, "tftp_sessions_started_total", "counter", "Transfers accepted.", started);
+    formatCounter(out, "tftp_sessions_completed_total", "counter", "Transfers that reached their last block.", completed);
+    formatCounter(out, "tftp_sessions_failed_total", "counter", "Transfers aborted or timed out.", failed);
+    formatCounter(out, "tftp_sessions_active", "gauge", "Transfers in progress.", started - completed - failed);
+    formatCounter(out, "tftp_transfer_bytes_total", "counter", "File bytes moved by completed transfers.", bytes);
+    formatHistogram(out, "tftp_transfer_duration_seconds", "Duration of completed transfers.", all, count,
+                    offsetof(ServerMetrics, durationBuckets), metric_duration_bounds, METRIC_DURATION_BUCKETS, seconds);
+    formatHistogram(out, "tftp_transfer_goodput_bytes_per_second", "Goodput of completed transfers.", all, count,
+                    offsetof(ServerMetrics, goodputBuckets), metric_goodput_bounds, METRIC_GOODPUT_BUCKETS,
+                    METRIC_SUM(all, count, goodputSum));
+}
+
+#endif
@@ -1,432 +1,2846 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+#include "session.h"
+#include "metrics.h"
+#include "../Commun/rto.h"
+#include "../Commun/writebehind.h"
+#include "../Commun/pool.h"
+#include "../Commun/packet.h"
+#include "../Commun/log.h"
+#include "../Commun/histogram.h"
 
 #define SIZE 516
 #define MAX_CLIENT 10
 #define MAX_RETRIES 3
 #define MAX_OACK_SIZE 512
+#define DEFAULT_BLKSIZE 512
+#define MIN_BLKSIZE 8
+#define MAX_BLKSIZE 65464
+#define DEFAULT_MAX_WINDOWSIZE 64
+#define MAX_WINDOWSIZE 65535
+#define MAX_EVENTS 64
+#define DEFAULT_BATCH_SIZE 32
+#define MAX_BATCH_SIZE 1024
+#define TX_INLINE_SIZE 128
+#define FILE_CACHE_BUCKETS 256
+#define DEFAULT_FILE_CACHE_MIB 256
+#define TIMER_TICK_MS 10
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+#define DEFAULT_READAHEAD_BLOCKS 64
+#define READAHEAD_MAX_IOV 64
+#define DEFAULT_IO_THREADS 2
+#define URING_MIN_ENTRIES 256
+#define URING_MAX_FILES 65536
+#define URING_TX_TAG 0
+#define URING_IGNORE_TAG 1
+
+/* Linux 5.14, missing from older headers. */
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+typedef struct EventLoop EventLoop;
+typedef struct Handler Handler;
+typedef struct Timer Timer;
+typedef struct Uring Uring;
+typedef struct ReadJob ReadJob;
+typedef struct ReadCompletions ReadCompletions;
+typedef void (*EventCallback)(EventLoop *loop, Handler *handler);
+typedef void (*TimerCallback)(EventLoop *loop, Timer *timer);
+
+struct Handler {
+    int fd;
+    EventCallback callback;
+    void *data;
+};
+
+/* A timer is armed in at most one wheel slot; pprev is NULL when it is not. */
+struct Timer {
+    uint64_t expires;
+    TimerCallback callback;
+    void *data;
+    Timer *next;
+    Timer **pprev;
+};
+
+/* Hierarchical timer wheel (4 levels of 64 slots, TIMER_TICK_MS per tick):
+   arming and cancelling only link or unlink a timer, and a tick only looks at
+   one slot, plus one slot per level every 64, 4096... ticks to cascade timers
+   down as their deadline gets close. now is the next tick to process. */
+typedef struct {
+    Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t now;
+    uint64_t startMs;
+    int armed;
+} TimerWheel;
+
+/* Readiness backend used by the event loop. Handlers must drain their fd until
+   EAGAIN, so level-triggered (select) and edge-triggered (epoll) behave alike. */
+typedef struct EventBackend {
+    const char *name;
+    int (*init)(EventLoop *loop);
+    int (*add)(EventLoop *loop, Handler *handler);
+    int (*remove)(EventLoop *loop, Handler *handler);
+    int (*wait)(EventLoop *loop, Handler **ready, int maxEvents, int timeoutMs);
+    void (*destroy)(EventLoop *loop);
+} EventBackend;
+
+struct EventLoop {
+    const EventBackend *backend;
+    int running;
+    void (*flush)(EventLoop *loop);
+    TimerWheel timers;
+    
+    /* epoll backend */
+    int epfd;
+    
+    /* select backend */
+    fd_set master_fds;
+    int max_fd;
+    Handler *handlers[FD_SETSIZE];
+    
+    /* io_uring backend */
+    Uring *uring;
+};
+
+typedef struct CachedFile {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    const char *map;
+    size_t size;
+    int refcount;
+    int stale;
+    int watch;
+    struct CachedFile *hashNext;
+    struct CachedFile *lruPrev;
+    struct CachedFile *lruNext;
+} CachedFile;
+
+typedef struct {
+    int enabled;
+    int inotifyFd;
+    Handler handler;
+    CachedFile *buckets[FILE_CACHE_BUCKETS];
+    CachedFile *lruOldest;
+    CachedFile *lruNewest;
+    size_t bytes;
+    size_t budget;
+    unsigned long hits;
+    unsigned long misses;
+} FileCache;
+
+/* Options found in a RRQ/WRQ; 0 means the option was not requested, except for
+   tsize (RFC 2349) where it is -1: a RRQ asks for the size with tsize 0. */
+typedef struct {
+    unsigned int bigfile;
+    int blksize;
+    int windowsize;
+    long long tsize;
+} RequestOptions;
+
+/* A read-ahead request for blocks [first, first + count) of a session: a
+   preadv() into the window ring, or for a mapped file a walk over its pages
+   so that the event loop never takes a major fault. */
+struct ReadJob {
+    Session *session;
+    int fd;
+    int seekable;
+    const char *map;
+    off_t offset;
+    size_t length;
+    struct iovec iov[READAHEAD_MAX_IOV];
+    int iovCount;
+    long long first;
+    int count;
+    ssize_t result;
+    int error;
+    ReadCompletions *completions;
+    ReadJob *next;
+};
+
+/* Blocks are tracked by their absolute index (1, 2, ...) and only folded to the
+   16-bit wire number when a packet is built, see wireBlock() in packet.h. */
+struct Session {
+    Handler handler;
+    struct sockaddr_in addr;
+    int sockfd;
+    int fileFd;
+    int isRead;
+    RequestOptions options;
+    uint32_t requestHash;
+    unsigned int bigfile;
+    int blksize;
+    int windowsize;
+    
+    /* RRQ: first unacknowledged block. WRQ: next block expected. */
+    long long base;
+    
+    /* RRQ sender state (RFC 7440): up to windowsize blocks in flight. */
+    long long next;
+    long long readIndex;
+    long long lastBlock;
+    int dupAckHandled;
+    char *window;
+    int *windowLengths;
+    
+    /* RRQ of a regular file: blocks are sent straight from a read-only mapping
+       shared through the file cache. */
+    CachedFile *cached;
+    const char *map;
+    size_t mapSize;
+    
+    /* Read-ahead: blocks up to readIndex are in memory, in the window ring
+       (windowsize + readahead_blocks slots) or resident in the mapping.
+       readJob belongs to the I/O pool while readPending is set, and a removed
+       session is only freed once its job came back (released). */
+    int ringSize;
+    int seekable;
+    int readPending;
+    int removed;
+    int released;
+    ReadJob readJob;
+    
+    /* WRQ receiver state. */
+    int sinceAck;
+    int gapAcked;
+    WriteBehind writer;
+    
+    /* An upload to a regular file is written to uploadPath, a temporary file
+       next to targetPath, and renamed over it once complete: RRQs still
+       reading the old file keep its inode. NULL when written in place. */
+    char *uploadPath;
+    char *targetPath;
+    size_t pathBytes;
+    
+    /* Retransmission: the timer is re-armed with the current RTO whenever the
+       transfer moves on. One packet at a time is timed: rttIndex is the block
+       whose ACK (RRQ) or arrival (WRQ) completes the sample, -1 if none. */
+    Timer timer;
+    int retries;
+    RttEstimator rtt;
+    long long rttIndex;
+    long long rttStart;
+    long long highestSent;
+    long long resentThrough;
+    long long lastAckSent;
+    unsigned long retransmits;
+    
+    /* Reported to the metrics when the session is removed. */
+    long long startedAt;
+    int completed;
+    int firstBlockTimed;
+    
+    Session *nextClosing;
+};
+
+static inline size_t windowBytes(Session *session) {
+    return (size_t)session->ringSize * (4 + session->blksize);
+}
+
+/* Outgoing packets are queued during an event loop iteration and flushed with
+   sendmmsg() at its end. Small control packets are copied into the queue; DATA
+   packets point into their session or its file mapping, which stay alive until
+   the flush. Each packet has up to two iovecs: header and payload. */
+typedef struct {
+    int fd;
+    struct sockaddr_in addr;
+    char data[TX_INLINE_SIZE];
+} TxPacket;
+
+typedef struct {
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    TxPacket *packets;
+    int count;
+} TxQueue;
+
+typedef struct {
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_in *addrs;
+    char *buffers;
+} RxBatch;
+
+typedef struct {
+    unsigned long recvCalls;
+    unsigned long recvPackets;
+    unsigned long sendCalls;
+    unsigned long sendPackets;
+} BatchStats;
+
+/* Finished jobs of one reactor; the I/O thread that adds the first one wakes
+   the reactor through eventFd. */
+struct ReadCompletions {
+    pthread_mutex_t mutex;
+    ReadJob *done;
+    int eventFd;
+    Handler handler;
+};
+
+/* I/O threads shared by every reactor. */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+    ReadJob *head;
+    ReadJob *tail;
+    int stopping;
+    pthread_t *threads;
+    int threadCount;
+} ReadPool;
+
+/* One reactor per thread: every reactor owns its server socket (SO_REUSEPORT),
+   event loop, sessions, file cache and batches. Nothing below is shared. */
+typedef struct {
+    int index;
+    int cpu;
+    const EventBackend *backend;
+    struct sockaddr_in addr;
+    size_t cacheBudget;
+    int stopFd;
+    ReadCompletions completions;
+    ServerMetrics metrics;
+    TransferLatency latency;
+} Reactor;
+
+__thread SessionTable session_table;
+__thread FileCache file_cache;
+__thread Session *closing_sessions = NULL;
+__thread TxQueue tx_queue;
+__thread RxBatch rx_batch;
+__thread BatchStats batch_stats;
+__thread ReadCompletions *read_completions;
+__thread ReadJob *read_submissions = NULL;
+__thread int read_jobs_pending = 0;
+__thread unsigned char *residency;
+__thread size_t residency_size;
+__thread Uring *tx_uring = NULL;
+__thread ServerMetrics *reactor_metrics;
+__thread TransferLatency *reactor_latency;
+
+/* Sessions, cache entries and their buffers come from per-reactor pools, so a
+   warm reactor serves transfers without touching the heap. */
+__thread Pool session_pool;
+__thread Pool cached_file_pool;
+__thread BufferPool buffer_pool;
+
+/* Loopback HTTP endpoint (-M port): any request gets the Prometheus text of
+   the moment. It runs on its own thread, so a scrape never delays a reactor. */
+typedef struct {
+    int fd;
+    pthread_t thread;
+    ServerMetrics **metrics;
+    int count;
+} MetricsEndpoint;
+
+/* Settings, written once before the reactors start. */
+char *server_ip = "127.0.0.1";
+int batch_size = DEFAULT_BATCH_SIZE;
+int max_blksize = MAX_BLKSIZE;
+int max_windowsize = DEFAULT_MAX_WINDOWSIZE;
+int rx_buffer_size = SIZE;
+int readahead_blocks = DEFAULT_READAHEAD_BLOCKS;
+ReadPool read_pool;
+
+void dieWithError(char *errorMessage);
+Session *addSession(EventLoop *loop, struct sockaddr_in addr, int fileFd, CachedFile *cached, int isRead, RequestOptions *options, uint32_t requestHash);
+void removeSession(EventLoop *loop, Session *session);
+void handleRequest(EventLoop *loop, int sockfd, char *buffer, int n, struct sockaddr_in addr);
+int handleSessionPacket(EventLoop *loop, Session *session, char *buffer, int n);
+void onSessionReadable(EventLoop *loop, Handler *handler);
+void onSessionTimeout(EventLoop *loop, Timer *timer);
+void fillWindow(Session *session);
+char *windowPacket(Session *session, long long index);
+void destroySession(Session *session);
+
+void dieWithError(char *errorMessage) {
+    perror(errorMessage);
+    exit(EXIT_FAILURE);
+}
+
+int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int epollInit(EventLoop *loop) {
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return loop->epfd < 0 ? -1 : 0;
+}
+
+int epollAdd(EventLoop *loop, Handler *handler) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = handler;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, handler->fd, &ev);
+}
+
+int epollRemove(EventLoop *loop, Handler *handler) {
+    return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, handler->fd, NULL);
+}
+
+int epollWait(EventLoop *loop, Handler **ready, int maxEvents, int timeoutMs) {
+    struct epoll_event events[MAX_EVENTS];
+    if (maxEvents > MAX_EVENTS)
+        maxEvents = MAX_EVENTS;
+    
+    int n = epoll_wait(loop->epfd, events, maxEvents, timeoutMs);
+    for (int i = 0; i < n; i++)
+        ready[i] = events[i].data.ptr;
+    return n;
+}
+
+void epollDestroy(EventLoop *loop) {
+    close(loop->epfd);
+}
+
+int selectInit(EventLoop *loop) {
+    FD_ZERO(&loop->master_fds);
+    loop->max_fd = -1;
+    memset(loop->handlers, 0, sizeof(loop->handlers));
+    return 0;
+}
+
+int selectAdd(EventLoop *loop, Handler *handler) {
+    if (handler->fd >= FD_SETSIZE) {
+        errno = EMFILE;
+        return -1;
+    }
+    FD_SET(handler->fd, &loop->master_fds);
+    loop->handlers[handler->fd] = handler;
+    if (handler->fd > loop->max_fd)
+        loop->max_fd = handler->fd;
+    return 0;
+}
+
+int selectRemove(EventLoop *loop, Handler *handler) {
+    FD_CLR(handler->fd, &loop->master_fds);
+    loop->handlers[handler->fd] = NULL;
+    while (loop->max_fd >= 0 && loop->handlers[loop->max_fd] == NULL)
+        loop->max_fd--;
+    return 0;
+}
+
+int selectWait(EventLoop *loop, Handler **ready, int maxEvents, int timeoutMs) {
+    fd_set read_fds = loop->master_fds;
+    struct timeval tv, *tvp = NULL;
+    if (timeoutMs >= 0) {
+        tv.tv_sec = timeoutMs / 1000;
+        tv.tv_usec = (timeoutMs % 1000) * 1000;
+        tvp = &tv;
+    }
+    
+    int activity = select(loop->max_fd + 1, &read_fds, NULL, NULL, tvp);
+    if (activity <= 0)
+        return activity;
+    
+    int n = 0;
+    for (int fd = 0; fd <= loop->max_fd && n < maxEvents; fd++) {
+        if (FD_ISSET(fd, &read_fds) && loop->handlers[fd] != NULL)
+            ready[n++] = loop->handlers[fd];
+    }
+    return n;
+}
+
+void selectDestroy(EventLoop *loop) {
+    FD_ZERO(&loop->master_fds);
+}
+
+/* io_uring backend, driven through the raw syscalls. Readiness comes from
+   multishot POLL_ADD requests tagged with the fd and a generation, so a
+   completion that arrives after its handler went away is recognised and
+   dropped. The tx queue goes out as SENDMSG SQEs for all sockets in one
+   io_uring_enter() (see flushTxQueue), and watched sockets are registered as
+   fixed files at their own fd number when the kernel lets us.
+
+   Nothing else goes through the ring:
+   - Receives stay one recvmmsg() per readable socket (receiveBatch). It drains
+     up to batch_size datagrams in one call, where RECVMSG costs an SQE and a
+     CQE per datagram and cannot know how many are queued.
+   - File reads are the read-ahead I/O threads' preadv() or page faults on the
+     cached mapping, and WRQ data is written by writeBehindFlush(); both are
+     shared by the three backends.
+   - No buffers are registered: SENDMSG and RECVMSG cannot use them. */
+struct Uring {
+    int fd;
+    void *ring;
+    size_t ringSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned sqEntries;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned pending;
+    int multishot;
+    int fileSlots;
+    
+    /* Indexed by fd. */
+    Handler **handlers;
+    uint32_t *generations;
+    char *fixed;
+    int slots;
+    
+    /* Poll tags completed but not yet handed to the loop. */
+    uint64_t *ready;
+    int readyCount;
+    int readyCapacity;
+};
+
+int uringSupportsOps(Uring *u) {
+    int ops[] = { IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_SENDMSG };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int ok = probe != NULL && syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, 256) >= 0;
+    
+    for (unsigned i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+void uringRelease(Uring *u) {
+    if (u->sqes != NULL && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqesSize);
+    if (u->ring != NULL && u->ring != MAP_FAILED)
+        munmap(u->ring, u->ringSize);
+    if (u->fd >= 0)
+        close(u->fd);
+    free(u->handlers);
+    free(u->generations);
+    free(u->fixed);
+    free(u->ready);
+}
+
+/* Creates and maps the rings; fails on kernels older than 5.11 (no timeout
+   in io_uring_enter) or when io_uring is disabled. */
+int uringSetup(Uring *u, unsigned entries) {
+    struct io_uring_params params;
+    memset(u, 0, sizeof(*u));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 4 * entries;
+    
+    u->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (u->fd < 0)
+        return -1;
+    
+    unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required || !uringSupportsOps(u)) {
+        uringRelease(u);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->ringSize = sqSize > cqSize ? sqSize : cqSize;
+    u->ring = mmap(NULL, u->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        uringRelease(u);
+        return -1;
+    }
+    
+    char *ring = u->ring;
+    u->sqHead = (unsigned *)(ring + params.sq_off.head);
+    u->sqTail = (unsigned *)(ring + params.sq_off.tail);
+    u->sqMask = (unsigned *)(ring + params.sq_off.ring_mask);
+    u->sqArray = (unsigned *)(ring + params.sq_off.array);
+    u->sqEntries = params.sq_entries;
+    u->cqHead = (unsigned *)(ring + params.cq_off.head);
+    u->cqTail = (unsigned *)(ring + params.cq_off.tail);
+    u->cqMask = (unsigned *)(ring + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+    
+    /* Multishot poll came with 5.13, like resource tags. */
+    u->multishot = (params.features & IORING_FEAT_RSRC_TAGS) != 0;
+    return 0;
+}
+
+int uringAvailable(void) {
+    Uring u;
+    if (uringSetup(&u, 8) < 0)
+        return 0;
+    uringRelease(&u);
+    return 1;
+}
+
+/* A sparse table as large as the fd limit; fixed files are simply not used
+   if the kernel refuses it. */
+void uringRegisterFiles(Uring *u) {
+    struct rlimit limit;
+    int slots = URING_MAX_FILES;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)slots)
+        slots = limit.rlim_cur;
+    
+    int *fds = malloc(slots * sizeof(int));
+    if (fds == NULL)
+        return;
+    memset(fds, -1, slots * sizeof(int));
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES, fds, slots) == 0)
+        u->fileSlots = slots;
+    free(fds);
+}
+
+int uringUpdateFile(Uring *u, int slot, int fd) {
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = (uint64_t)(uintptr_t)&fd;
+    return syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1 ? 0 : -1;
+}
+
+/* Submits every pending SQE and, if minComplete is set, waits up to
+   timeoutMs (-1: forever) for completions. */
+int uringEnter(Uring *u, unsigned minComplete, int timeoutMs) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned flags = 0;
+    void *argp = NULL;
+    size_t argSize = 0;
+    
+    if (minComplete > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeoutMs >= 0) {
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argSize = sizeof(arg);
+        }
+    }
+    
+    int r = syscall(__NR_io_uring_enter, u->fd, u->pending, minComplete, flags, argp, argSize);
+    u->pending = *u->sqTail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE);
+    if (r < 0 && errno == ETIME)
+        return 0;
+    return r;
+}
+
+struct io_uring_sqe *uringSqe(Uring *u) {
+    if (u->pending == u->sqEntries && uringEnter(u, 0, 0) < 0)
+        dieWithError("[ERROR] io_uring submit error");
+    
+    unsigned tail = *u->sqTail;
+    unsigned index = tail & *u->sqMask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sqArray[index] = index;
+    __atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+    u->pending++;
+    return sqe;
+}
+
+void uringSetFd(Uring *u, struct io_uring_sqe *sqe, int fd) {
+    sqe->fd = fd;
+    if (fd < u->slots && u->handlers[fd] != NULL && u->fixed[fd])
+        sqe->flags |= IOSQE_FIXED_FILE;
+}
+
+uint64_t uringPollTag(Uring *u, int fd) {
+    return (uint64_t)u->generations[fd] << 32 | (uint32_t)fd;
+}
+
+void uringArmPoll(Uring *u, int fd) {
+    struct io_uring_sqe *sqe = uringSqe(u);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    uringSetFd(u, sqe, fd);
+    sqe->poll32_events = POLLIN;
+    sqe->len = u->multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = uringPollTag(u, fd);
+}
+
+void uringPollCompleted(Uring *u, struct io_uring_cqe *cqe) {
+    int fd = (uint32_t)cqe->user_data;
+    if (fd >= u->slots || u->handlers[fd] == NULL || uringPollTag(u, fd) != cqe->user_data)
+        return;
+    
+    if (cqe->res < 0) {
+        errno = -cqe->res;
+        perror("[ERROR] io_uring poll error");
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        uringArmPoll(u, fd);
+    
+    if (u->readyCount == u->readyCapacity) {
+        int capacity = u->readyCapacity ? 2 * u->readyCapacity : MAX_EVENTS;
+        uint64_t *ready = realloc(u->ready, capacity * sizeof(uint64_t));
+        if (ready == NULL)
+            dieWithError("[ERROR] malloc error");
+        u->ready = ready;
+        u->readyCapacity = capacity;
+    }
+    u->ready[u->readyCount++] = cqe->user_data;
+}
+
+void uringReap(Uring *u) {
+    unsigned head = *u->cqHead;
+    unsigned tail = __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE);
+    int dropped = 0;
+    
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cqMask];
+        if (cqe->user_data == URING_TX_TAG) {
+            if (cqe->res >= 0) {
+                batch_stats.sendPackets++;
+                metricAdd(&reactor_metrics->packetsOut, 1);
+                metricAdd(&reactor_metrics->bytesOut, cqe->res);
+            }
+            else if (cqe->res == -EAGAIN)
+                dropped++;
+            else {
+                errno = -cqe->res;
+                perror("[ERROR] io_uring sendmsg error");
+            }
+        } else if (cqe->user_data != URING_IGNORE_TAG) {
+            uringPollCompleted(u, cqe);
+        }
+    }
+    __atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+    
+    if (dropped > 0)
+        LOG(LOG_WARNING, "event=send_dropped packets=%d", dropped);
+}
+
+int uringGrow(Uring *u, int fd) {
+    int slots = u->slots ? u->slots : 64;
+    while (slots <= fd)
+        slots *= 2;
+    
+    Handler **handlers = realloc(u->handlers, slots * sizeof(Handler *));
+    if (handlers != NULL)
+        u->handlers = handlers;
+    uint32_t *generations = realloc(u->generations, slots * sizeof(uint32_t));
+    if (generations != NULL)
+        u->generations = generations;
+    char *fixed = realloc(u->fixed, slots);
+    if (fixed != NULL)
+        u->fixed = fixed;
+    if (handlers == NULL || generations == NULL || fixed == NULL)
+        return -1;
+    
+    memset(u->handlers + u->slots, 0, (slots - u->slots) * sizeof(Handler *));
+    memset(u->generations + u->slots, 0, (slots - u->slots) * sizeof(uint32_t));
+    memset(u->fixed + u->slots, 0, slots - u->slots);
+    u->slots = slots;
+    return 0;
+}
+
+int uringInit(EventLoop *loop) {
+    Uring *u = malloc(sizeof(Uring));
+    unsigned entries = 2 * batch_size > URING_MIN_ENTRIES ? 2 * batch_size : URING_MIN_ENTRIES;
+    if (u == NULL)
+        return -1;
+    if (uringSetup(u, entries) < 0) {
+        free(u);
+        return -1;
+    }
+    
+    uringRegisterFiles(u);
+    loop->uring = u;
+    tx_uring = u;
+    return 0;
+}
+
+int uringAdd(EventLoop *loop, Handler *handler) {
+    Uring *u = loop->uring;
+    int fd = handler->fd;
+    if (fd >= u->slots && uringGrow(u, fd) < 0)
+        return -1;
+    
+    u->handlers[fd] = handler;
+    if (++u->generations[fd] == 0)
+        u->generations[fd] = 1;
+    u->fixed[fd] = fd < u->fileSlots && uringUpdateFile(u, fd, fd) == 0;
+    uringArmPoll(u, fd);
+    return 0;
+}
+
+/* The POLL_REMOVE goes out with the next submission, before the session's
+   socket is closed by releaseClosedSessions(). */
+int uringRemove(EventLoop *loop, Handler *handler) {
+    Uring *u = loop->uring;
+    int fd = handler->fd;
+    if (fd >= u->slots || u->handlers[fd] != handler)
+        return 0;
+    
+    struct io_uring_sqe *sqe = uringSqe(u);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = uringPollTag(u, fd);
+    sqe->user_data = URING_IGNORE_TAG;
+    
+    u->handlers[fd] = NULL;
+    if (u->fixed[fd])
+        uringUpdateFile(u, fd, -1);
+    u->fixed[fd] = 0;
+    return 0;
+}
+
+int uringWait(EventLoop *loop, Handler **ready, int maxEvents, int timeoutMs) {
+    Uring *u = loop->uring;
+    
+    uringReap(u);
+    if (u->readyCount == 0 || u->pending > 0) {
+        if (uringEnter(u, u->readyCount == 0, timeoutMs) < 0)
+            return -1;
+        uringReap(u);
+    }
+    
+    int n = 0, i;
+    for (i = 0; i < u->readyCount && n < maxEvents; i++) {
+        int fd = (uint32_t)u->ready[i];
+        if (u->handlers[fd] != NULL && uringPollTag(u, fd) == u->ready[i])
+            ready[n++] = u->handlers[fd];
+    }
+    memmove(u->ready, u->ready + i, (u->readyCount - i) * sizeof(uint64_t));
+    u->readyCount -= i;
+    return n;
+}
+
+void uringDestroy(EventLoop *loop) {
+    uringRelease(loop->uring);
+    free(loop->uring);
+    loop->uring = NULL;
+    tx_uring = NULL;
+}
+
+/* Hands the whole tx queue to the kernel in one io_uring_enter(). With
+   MSG_DONTWAIT every send runs during the submission itself, so the queued
+   buffers can be reused as soon as it returns, as after sendmmsg(). */
+void submitTxQueue(Uring *u) {
+    for (int i = 0; i < tx_queue.count; i++) {
+        struct io_uring_sqe *sqe = uringSqe(u);
+        sqe->opcode = IORING_OP_SENDMSG;
+        uringSetFd(u, sqe, tx_queue.packets[i].fd);
+        sqe->addr = (uint64_t)(uintptr_t)&tx_queue.msgs[i].msg_hdr;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT;
+        sqe->user_data = URING_TX_TAG;
+    }
+    
+    if (uringEnter(u, 0, 0) < 0)
+        perror("[ERROR] io_uring submit error");
+    else
+        batch_stats.sendCalls++;
+    uringReap(u);
+}
+
+const EventBackend epollBackend = { "epoll", epollInit, epollAdd, epollRemove, epollWait, epollDestroy };
+const EventBackend selectBackend = { "select", selectInit, selectAdd, selectRemove, selectWait, selectDestroy };
+const EventBackend uringBackend = { "io_uring", uringInit, uringAdd, uringRemove, uringWait, uringDestroy };
+
+const EventBackend *findBackend(const char *name) {
+    if (name == NULL || strcmp(name, epollBackend.name) == 0)
+        return &epollBackend;
+    if (strcmp(name, selectBackend.name) == 0)
+        return &selectBackend;
+    if (strcmp(name, uringBackend.name) == 0)
+        return &uringBackend;
+    return NULL;
+}
+
+uint64_t monotonicMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void initEventLoop(EventLoop *loop, const EventBackend *backend) {
+    memset(loop, 0, sizeof(*loop));
+    loop->backend = backend;
+    loop->timers.startMs = monotonicMs();
+    if (backend->init(loop) < 0)
+        dieWithError("[ERROR] event loop init error");
+}
+
+void placeTimer(TimerWheel *wheel, Timer *timer) {
+    uint64_t delta = timer->expires > wheel->now ? timer->expires - wheel->now : 0;
+    int level = 0;
+    
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+        level++;
+    if (delta >= (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+        timer->expires = wheel->now + (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    if (timer->expires < wheel->now)
+        timer->expires = wheel->now;
+    
+    Timer **slot = &wheel->slots[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+    timer->next = *slot;
+    if (*slot != NULL)
+        (*slot)->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+void unlinkTimer(Timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void cancelTimer(EventLoop *loop, Timer *timer) {
+    if (timer->pprev == NULL)
+        return;
+    unlinkTimer(timer);
+    loop->timers.armed--;
+}
+
+/* Fires the timer after at least delayMs. */
+void armTimer(EventLoop *loop, Timer *timer, int delayMs) {
+    TimerWheel *wheel = &loop->timers;
+    uint64_t ticks = (delayMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    
+    cancelTimer(loop, timer);
+    timer->expires = wheel->now + (ticks > 0 ? ticks : 1);
+    placeTimer(wheel, timer);
+    wheel->armed++;
+}
+
+/* Moves every timer of a higher-level slot one or more levels down. */
+void cascadeTimers(TimerWheel *wheel, int level) {
+    Timer **slot = &wheel->slots[level][(wheel->now >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+    Timer *timer = *slot;
+    *slot = NULL;
+    
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        placeTimer(wheel, timer);
+        timer = next;
+    }
+}
+
+/* Runs every tick up to the current time. A callback may arm or cancel any
+   timer, itself included. */
+void advanceTimers(EventLoop *loop) {
+    TimerWheel *wheel = &loop->timers;
+    uint64_t target = (monotonicMs() - wheel->startMs) / TIMER_TICK_MS;
+    
+    if (wheel->armed == 0 && wheel->now <= target) {
+        wheel->now = target + 1;
+        return;
+    }
+    
+    while (wheel->now <= target) {
+        int index = wheel->now & (TIMER_WHEEL_SLOTS - 1);
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((wheel->now >> (TIMER_WHEEL_BITS * (level - 1))) & (TIMER_WHEEL_SLOTS - 1))
+                break;
+            cascadeTimers(wheel, level);
+        }
+        
+        Timer *timer;
+        while ((timer = wheel->slots[0][index]) != NULL) {
+            unlinkTimer(timer);
+            wheel->armed--;
+            timer->callback(loop, timer);
+        }
+        wheel->now++;
+    }
+}
+
+/* Milliseconds until the earliest non-empty slot is due, -1 if no timer is
+   armed. A higher-level slot counts from the start of its range, so the
+   loop may wake up only to cascade, never too late. */
+int nextTimerTimeout(EventLoop *loop) {
+    TimerWheel *wheel = &loop->timers;
+    uint64_t next = UINT64_MAX;
+    
+    if (wheel->armed == 0)
+        return -1;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        int shift = TIMER_WHEEL_BITS * level;
+        for (uint64_t offset = level == 0 ? 0 : 1; offset <= TIMER_WHEEL_SLOTS; offset++) {
+            uint64_t range = (wheel->now >> shift) + offset;
+            if (wheel->slots[level][range & (TIMER_WHEEL_SLOTS - 1)] != NULL) {
+                uint64_t start = range << shift;
+                if (start < next)
+                    next = start;
+                break;
+            }
+        }
+    }
+    
+    uint64_t dueMs = wheel->startMs + next * TIMER_TICK_MS;
+    uint64_t nowMs = monotonicMs();
+    return dueMs > nowMs ? (int)(dueMs - nowMs) : 0;
+}
+
+void watchFd(EventLoop *loop, Handler *handler) {
+    if (loop->backend->add(loop, handler) < 0)
+        dieWithError("[ERROR] event loop add error");
+}
+
+void unwatchFd(EventLoop *loop, Handler *handler) {
+    loop->backend->remove(loop, handler);
+}
+
+void runEventLoop(EventLoop *loop) {
+    Handler *ready[MAX_EVENTS];
+    loop->running = 1;
+    
+    while (loop->running) {
+        int n = loop->backend->wait(loop, ready, MAX_EVENTS, nextTimerTimeout(loop));
+        if (n < 0) {
+            if (errno != EINTR)
+                dieWithError("[ERROR] event loop wait error");
+            n = 0;
+        }
+        
+        for (int i = 0; i < n; i++)
+            ready[i]->callback(loop, ready[i]);
+        
+        advanceTimers(loop);
+        
+        if (loop->flush != NULL)
+            loop->flush(loop);
+    }
+}
+
+void initBatchIO(void) {
+    tx_queue.msgs = calloc(batch_size, sizeof(struct mmsghdr));
+    tx_queue.iovs = calloc(2 * batch_size, sizeof(struct iovec));
+    tx_queue.packets = calloc(batch_size, sizeof(TxPacket));
+    tx_queue.count = 0;
+    
+    rx_batch.msgs = calloc(batch_size, sizeof(struct mmsghdr));
+    rx_batch.iovs = calloc(batch_size, sizeof(struct iovec));
+    rx_batch.addrs = calloc(batch_size, sizeof(struct sockaddr_in));
+    rx_buffer_size = 4 + max_blksize;
+    rx_batch.buffers = calloc(batch_size, rx_buffer_size + 1);
+    
+    if (tx_queue.msgs == NULL || tx_queue.iovs == NULL || tx_queue.packets == NULL ||
+        rx_batch.msgs == NULL || rx_batch.iovs == NULL || rx_batch.addrs == NULL || rx_batch.buffers == NULL)
+        dieWithError("[ERROR] batch buffers allocation error");
+}
+
+void destroyBatchIO(void) {
+    free(tx_queue.msgs);
+    free(tx_queue.iovs);
+    free(tx_queue.packets);
+    free(rx_batch.msgs);
+    free(rx_batch.iovs);
+    free(rx_batch.addrs);
+    free(rx_batch.buffers);
+    free(residency);
+    residency = NULL;
+    residency_size = 0;
+}
+
+void flushTxQueue(void) {
+    int start = 0;
+    
+    if (tx_uring != NULL && tx_queue.count > 0) {
+        submitTxQueue(tx_uring);
+        start = tx_queue.count;
+    }
+    
+    while (start < tx_queue.count) {
+        int fd = tx_queue.packets[start].fd;
+        int end = start + 1;
+        while (end < tx_queue.count && tx_queue.packets[end].fd == fd)
+            end++;
+        
+        /* Packets are grouped per socket, sendmmsg() may still send only a prefix. */
+        while (start < end) {
+            int n = sendmmsg(fd, tx_queue.msgs + start, end - start, 0);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    perror("[ERROR] sendmmsg error");
+                else
+                    LOG(LOG_WARNING, "event=send_dropped packets=%d", end - start);
+                break;
+            }
+            batch_stats.sendCalls++;
+            batch_stats.sendPackets += n;
+            unsigned long bytes = 0;
+            for (int i = start; i < start + n; i++)
+                bytes += tx_queue.msgs[i].msg_len;
+            metricAdd(&reactor_metrics->packetsOut, n);
+            metricAdd(&reactor_metrics->bytesOut, bytes);
+            start += n;
+        }
+        start = end;
+    }
+    tx_queue.count = 0;
+}
+
+TxPacket *queueSlot(int fd, struct sockaddr_in *addr, struct iovec **iov) {
+    if (tx_queue.count == batch_size)
+        flushTxQueue();
+    
+    int i = tx_queue.count++;
+    TxPacket *packet = &tx_queue.packets[i];
+    packet->fd = fd;
+    packet->addr = *addr;
+    
+    *iov = &tx_queue.iovs[2 * i];
+    memset(&tx_queue.msgs[i], 0, sizeof(struct mmsghdr));
+    tx_queue.msgs[i].msg_hdr.msg_name = &packet->addr;
+    tx_queue.msgs[i].msg_hdr.msg_namelen = sizeof(packet->addr);
+    tx_queue.msgs[i].msg_hdr.msg_iov = *iov;
+    tx_queue.msgs[i].msg_hdr.msg_iovlen = 1;
+    return packet;
+}
+
+/* When copy is set the packet is duplicated into the queue, otherwise data must
+   stay valid until the next flush. */
+void queuePacket(int fd, struct sockaddr_in *addr, const char *data, int len, int copy) {
+    struct iovec *iov;
+    TxPacket *packet = queueSlot(fd, addr, &iov);
+    
+    if (copy) {
+        if (len > TX_INLINE_SIZE)
+            len = TX_INLINE_SIZE;
+        memcpy(packet->data, data, len);
+        data = packet->data;
+    }
+    
+    iov[0].iov_base = (void *)data;
+    iov[0].iov_len = len;
+}
+
+/* Gathers a DATA header and its payload; only the 4-byte header is copied. */
+void queueDataPacket(int fd, struct sockaddr_in *addr, const char *header, const char *payload, int len) {
+    struct iovec *iov;
+    TxPacket *packet = queueSlot(fd, addr, &iov);
+    
+    memcpy(packet->data, header, 4);
+    iov[0].iov_base = packet->data;
+    iov[0].iov_len = 4;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+    tx_queue.msgs[packet - tx_queue.packets].msg_hdr.msg_iovlen = len > 0 ? 2 : 1;
+}
+
+/* Receive buffers are sized for the largest blksize the server accepts. */
+char *batchBuffer(int i) {
+    return rx_batch.buffers + (size_t)i * (rx_buffer_size + 1);
+}
+
+/* Reads up to batch_size datagrams; each buffer is NUL-terminated after its payload. */
+int receiveBatch(int fd) {
+    for (int i = 0; i < batch_size; i++) {
+        rx_batch.iovs[i].iov_base = batchBuffer(i);
+        rx_batch.iovs[i].iov_len = rx_buffer_size;
+        memset(&rx_batch.msgs[i], 0, sizeof(struct mmsghdr));
+        rx_batch.msgs[i].msg_hdr.msg_name = &rx_batch.addrs[i];
+        rx_batch.msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        rx_batch.msgs[i].msg_hdr.msg_iov = &rx_batch.iovs[i];
+        rx_batch.msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    
+    int n;
+    do {
+        n = recvmmsg(fd, rx_batch.msgs, batch_size, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+    
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        dieWithError("[ERROR] recvmmsg error");
+    }
+    
+    batch_stats.recvCalls++;
+    batch_stats.recvPackets += n;
+    unsigned long bytes = 0;
+    for (int i = 0; i < n; i++) {
+        batchBuffer(i)[rx_batch.msgs[i].msg_len] = 0;
+        bytes += rx_batch.msgs[i].msg_len;
+    }
+    metricAdd(&reactor_metrics->packetsIn, n);
+    metricAdd(&reactor_metrics->bytesIn, bytes);
+    return n;
+}
+
+void printBatchStats(void) {
+    printf("[STATS] recvmmsg: %lu calls, %lu packets, %.2f packets/call\n", batch_stats.recvCalls, batch_stats.recvPackets,
+           batch_stats.recvCalls ? (double)batch_stats.recvPackets / batch_stats.recvCalls : 0.0);
+    printf("[STATS] %s: %lu calls, %lu packets, %.2f packets/call\n", tx_uring != NULL ? "io_uring sends" : "sendmmsg",
+           batch_stats.sendCalls, batch_stats.sendPackets,
+           batch_stats.sendCalls ? (double)batch_stats.sendPackets / batch_stats.sendCalls : 0.0);
+}
+
+void printPoolStats(void) {
+    printf("[STATS] pools: %lu sessions (peak %lu), %lu buffers, %lu heap allocations\n", session_pool.gets,
+           session_pool.peak, bufferPoolGets(&buffer_pool),
+           session_pool.slabs + cached_file_pool.slabs + bufferPoolSlabs(&buffer_pool));
+}
+
+void sendErrorPacket(int sockfd, struct sockaddr_in *addr, int errorCode, const char *errorMessage) {
+    char errorBuffer[SIZE];
+    int errorBufferLen = packError(errorBuffer, SIZE, errorCode, errorMessage);
+    
+    if (errorBufferLen > 0) {
+        queuePacket(sockfd, addr, errorBuffer, errorBufferLen, 1);
+        metricAdd(&reactor_metrics->errorsSent, 1);
+    }
+}
+
+/* Each transfer gets its own socket bound to an ephemeral port (its TID, RFC 1350),
+   so the kernel demultiplexes DATA/ACK traffic instead of the session table. */
+int openTransferSocket(void) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+        return -1;
+    
+    struct sockaddr_in local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_port = 0;
+    local_addr.sin_addr.s_addr = inet_addr(server_ip);
+    
+    if (bind(sockfd, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0 || setNonBlocking(sockfd) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/* Read-only files shared by every RRQ that asks for them. An entry is keyed by
+   path and remembers the inode and mtime it was mapped from; inotify marks it
+   stale when the file changes, so a hit costs no file-system syscall. Entries
+   nobody uses stay mapped, oldest evicted first past the memory budget. */
+uint32_t hashPath(const char *path) {
+    uint32_t h = 2166136261u;
+    while (*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h;
+}
+
+void lruUnlink(CachedFile *file) {
+    if (file->lruPrev != NULL)
+        file->lruPrev->lruNext = file->lruNext;
+    else
+        file_cache.lruOldest = file->lruNext;
+    if (file->lruNext != NULL)
+        file->lruNext->lruPrev = file->lruPrev;
+    else
+        file_cache.lruNewest = file->lruPrev;
+    file->lruPrev = file->lruNext = NULL;
+}
+
+void lruPush(CachedFile *file) {
+    file->lruPrev = file_cache.lruNewest;
+    file->lruNext = NULL;
+    if (file_cache.lruNewest != NULL)
+        file_cache.lruNewest->lruNext = file;
+    else
+        file_cache.lruOldest = file;
+    file_cache.lruNewest = file;
+}
+
+void destroyCachedFile(CachedFile *file) {
+    munmap((void *)file->map, file->size);
+    bufferPut(&buffer_pool, file->path, strlen(file->path) + 1);
+    poolPut(&cached_file_pool, file);
+}
+
+/* Drops an entry from the index; the mapping lives on until its last session ends.
+   Those sessions finish with the old contents because a WRQ never writes into
+   an existing file: openUpload() writes a new inode and renames it over the
+   path. A private mapping is not a snapshot, though: a file rewritten in place
+   by another program still shows through, or faults if it shrinks. */
+void invalidateCachedFile(CachedFile *file) {
+    if (file->stale)
+        return;
+    
+    CachedFile **link = &file_cache.buckets[hashPath(file->path) % FILE_CACHE_BUCKETS];
+    while (*link != file)
+        link = &(*link)->hashNext;
+    *link = file->hashNext;
+    lruUnlink(file);
+    file_cache.bytes -= file->size;
+    file->stale = 1;
+    
+    int shared = 0;
+    for (CachedFile *other = file_cache.lruOldest; other != NULL; other = other->lruNext)
+        shared |= other->watch == file->watch;
+    if (!shared)
+        inotify_rm_watch(file_cache.inotifyFd, file->watch);
+    
+    if (file->refcount == 0)
+        destroyCachedFile(file);
+}
+
+void evictCachedFiles(void) {
+    CachedFile *file = file_cache.lruOldest;
+    while (file != NULL && file_cache.bytes > file_cache.budget) {
+        CachedFile *next = file->lruNext;
+        if (file->refcount == 0)
+            invalidateCachedFile(file);
+        file = next;
+    }
+}
+
+/* Returns a mapping of a regular, non-empty file, or NULL if it cannot be
+   mapped (errno tells why). When the cache is disabled or the file cannot be
+   watched, the mapping is private to the caller. */
+CachedFile *acquireCachedFile(const char *path) {
+    uint32_t bucket = hashPath(path) % FILE_CACHE_BUCKETS;
+    
+    if (file_cache.enabled) {
+        for (CachedFile *file = file_cache.buckets[bucket]; file != NULL; file = file->hashNext) {
+            if (strcmp(file->path, path) == 0) {
+                file->refcount++;
+                lruUnlink(file);
+                lruPush(file);
+                file_cache.hits++;
+                return file;
+            }
+        }
+        file_cache.misses++;
+    }
+    
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    
+    CachedFile *file = poolGet(&cached_file_pool);
+    char *copy = bufferGet(&buffer_pool, strlen(path) + 1);
+    if (file == NULL || copy == NULL)
+        dieWithError("[ERROR] malloc error");
+    memset(file, 0, sizeof(CachedFile));
+    file->path = strcpy(copy, path);
+    file->map = map;
+    file->size = st.st_size;
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    file->mtime = st.st_mtim;
+    file->refcount = 1;
+    file->stale = 1;
+    
+    if (file_cache.enabled) {
+        file->watch = inotify_add_watch(file_cache.inotifyFd, path, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+        if (file->watch >= 0) {
+            file->stale = 0;
+            file->hashNext = file_cache.buckets[bucket];
+            file_cache.buckets[bucket] = file;
+            lruPush(file);
+            file_cache.bytes += file->size;
+            evictCachedFiles();
+        }
+    }
+    return file;
+}
+
+void releaseCachedFile(CachedFile *file) {
+    if (--file->refcount > 0)
+        return;
+    if (file->stale)
+        destroyCachedFile(file);
+    else
+        evictCachedFiles();
+}
+
+/* A bare attribute change (chmod, link count) keeps the entry as long as the
+   path still names the same inode with the same mtime. */
+int sameFileVersion(CachedFile *file, uint32_t mask) {
+    struct stat st;
+    if (mask != IN_ATTRIB || stat(file->path, &st) < 0)
+        return 0;
+    return st.st_dev == file->dev && st.st_ino == file->ino && st.st_nlink > 0 &&
+           st.st_mtim.tv_sec == file->mtime.tv_sec && st.st_mtim.tv_nsec == file->mtime.tv_nsec;
+}
+
+void onInotifyReadable(EventLoop *loop, Handler *handler) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    (void)loop;
+    
+    while (1) {
+        ssize_t n = read(handler->fd, events, sizeof(events));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        
+        for (char *ptr = events; ptr < events + n; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            CachedFile *file = file_cache.lruOldest;
+            while (file != NULL) {
+                CachedFile *next = file->lruNext;
+                if (file->watch == event->wd && !sameFileVersion(file, event->mask)) {
+                    LOG(LOG_INFO, "event=cache_invalidated path=\"%s\"", file->path);
+                    invalidateCachedFile(file);
+                }
+                file = next;
+            }
+        }
+    }
+}
+
+void initFileCache(EventLoop *loop, size_t budget) {
+    memset(&file_cache, 0, sizeof(file_cache));
+    file_cache.budget = budget;
+    if (budget == 0)
+        return;
+    
+    file_cache.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (file_cache.inotifyFd < 0) {
+        perror("[WARNING] inotify unavailable, file cache disabled");
+        return;
+    }
+    file_cache.enabled = 1;
+    file_cache.handler.fd = file_cache.inotifyFd;
+    file_cache.handler.callback = onInotifyReadable;
+    file_cache.handler.data = NULL;
+    watchFd(loop, &file_cache.handler);
+}
+
+void printFileCacheStats(void) {
+    unsigned long lookups = file_cache.hits + file_cache.misses;
+    printf("[STATS] file cache: %lu hits, %lu misses, %.1f%% hit rate, %zu bytes cached\n", file_cache.hits, file_cache.misses,
+           lookups ? 100.0 * file_cache.hits / lookups : 0.0, file_cache.bytes);
+}
+
+/* Whether every page behind [addr, addr + len) is in the page cache. */
+int mappingResident(const char *addr, size_t len) {
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(uintptr_t)(page - 1);
+    size_t pages = ((uintptr_t)addr + len - start + page - 1) / page;
+    
+    if (pages > residency_size) {
+        unsigned char *vec = realloc(residency, pages);
+        if (vec == NULL)
+            return 0;
+        residency = vec;
+        residency_size = pages;
+    }
+    if (mincore((void *)start, pages * page, residency) < 0)
+        return 0;
+    for (size_t i = 0; i < pages; i++) {
+        if (!(residency[i] & 1))
+            return 0;
+    }
+    return 1;
+}
+
+/* Keeps readahead_blocks blocks ready past the window. Mapped blocks that are
+   already resident need no job, readIndex simply moves on. */
+void scheduleReadAhead(Session *session) {
+    if (session->readPending || (session->lastBlock != 0 && session->readIndex >= session->lastBlock))
+        return;
+    
+    long long first = session->readIndex + 1;
+    long long last = (session->base > 0 ? session->base : 1) + session->windowsize + readahead_blocks - 1;
+    if (session->lastBlock != 0 && last > session->lastBlock)
+        last = session->lastBlock;
+    
+    /* Wait for a worthwhile batch unless the window itself is short of blocks. */
+    if (last < first || (last - first + 1 < (readahead_blocks + 3) / 4 && first >= session->base + session->windowsize))
+        return;
+    
+    ReadJob *job = &session->readJob;
+    job->session = session;
+    job->first = first;
+    job->result = 0;
+    job->error = 0;
+    job->completions = read_completions;
+    
+    if (session->map != NULL) {
+        size_t start = (size_t)(first - 1) * session->blksize;
+        size_t end = (size_t)last * session->blksize;
+        if (end > session->mapSize)
+            end = session->mapSize;
+        if (start >= end || mappingResident(session->map + start, end - start)) {
+            session->readIndex = last;
+            return;
+        }
+        job->fd = -1;
+        job->map = session->map + start;
+        job->length = end - start;
+        job->count = last - first + 1;
+    } else {
+        job->fd = session->fileFd;
+        job->seekable = session->seekable;
+        job->map = NULL;
+        job->offset = (off_t)(first - 1) * session->blksize;
+        job->count = last - first + 1 > READAHEAD_MAX_IOV ? READAHEAD_MAX_IOV : last - first + 1;
+        for (int i = 0; i < job->count; i++) {
+            job->iov[i].iov_base = windowPacket(session, first + i) + 4;
+            job->iov[i].iov_len = session->blksize;
+        }
+        job->iovCount = job->count;
+    }
+    
+    session->readPending = 1;
+    read_jobs_pending++;
+    job->next = read_submissions;
+    read_submissions = job;
+}
+
+void submitReadAheads(void) {
+    if (read_submissions == NULL)
+        return;
+    
+    pthread_mutex_lock(&read_pool.mutex);
+    while (read_submissions != NULL) {
+        ReadJob *job = read_submissions;
+        read_submissions = job->next;
+        job->next = NULL;
+        if (read_pool.tail != NULL)
+            read_pool.tail->next = job;
+        else
+            read_pool.head = job;
+        read_pool.tail = job;
+        pthread_cond_signal(&read_pool.notEmpty);
+    }
+    pthread_mutex_unlock(&read_pool.mutex);
+}
+
+/* Runs on an I/O thread. A file read goes on until the blocks are full or the
+   file ends, so a short result always means end of file. */
+void runReadJob(ReadJob *job) {
+    if (job->map != NULL) {
+        long page = sysconf(_SC_PAGESIZE);
+        const char *start = (const char *)((uintptr_t)job->map & ~(uintptr_t)(page - 1));
+        const char *end = job->map + job->length;
+        
+        /* The kernel faults the pages in; touching them here would raise
+           SIGBUS in the whole process if the file shrank under the mapping,
+           where MADV_POPULATE_READ fails with EFAULT. Kernels before 5.14
+           only get the asynchronous read-ahead hint. */
+        if (madvise((void *)start, end - start, MADV_POPULATE_READ) < 0) {
+            if (errno == EINVAL)
+                madvise((void *)start, end - start, MADV_WILLNEED);
+            else if (errno == EFAULT)
+                job->error = EFAULT;
+        }
+        job->result = job->length;
+        return;
+    }
+    
+    struct iovec *iov = job->iov;
+    int iovCount = job->iovCount;
+    size_t total = 0;
+    
+    while (iovCount > 0) {
+        ssize_t n = job->seekable ? preadv(job->fd, iov, iovCount, job->offset + total) : readv(job->fd, iov, iovCount);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            job->error = errno;
+            break;
+        }
+        if (n == 0)
+            break;
+        
+        total += n;
+        while (iovCount > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovCount--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    job->result = total;
+}
+
+void *readPoolLoop(void *arg) {
+    (void)arg;
+    
+    while (1) {
+        pthread_mutex_lock(&read_pool.mutex);
+        while (read_pool.head == NULL && !read_pool.stopping)
+            pthread_cond_wait(&read_pool.notEmpty, &read_pool.mutex);
+        ReadJob *job = read_pool.head;
+        if (job == NULL) {
+            pthread_mutex_unlock(&read_pool.mutex);
+            return NULL;
+        }
+        read_pool.head = job->next;
+        if (read_pool.head == NULL)
+            read_pool.tail = NULL;
+        pthread_mutex_unlock(&read_pool.mutex);
+        
+        runReadJob(job);
+        
+        ReadCompletions *completions = job->completions;
+        pthread_mutex_lock(&completions->mutex);
+        int wake = completions->done == NULL;
+        job->next = completions->done;
+        completions->done = job;
+        pthread_mutex_unlock(&completions->mutex);
+        
+        uint64_t one = 1;
+        if (wake && write(completions->eventFd, &one, sizeof(one)) < 0)
+            perror("[ERROR] eventfd write error");
+    }
+}
+
+void startReadPool(int threadCount) {
+    pthread_mutex_init(&read_pool.mutex, NULL);
+    pthread_cond_init(&read_pool.notEmpty, NULL);
+    read_pool.threads = calloc(threadCount, sizeof(pthread_t));
+    if (read_pool.threads == NULL)
+        dieWithError("[ERROR] malloc error");
+    
+    for (int i = 0; i < threadCount; i++) {
+        if (pthread_create(&read_pool.threads[i], NULL, readPoolLoop, NULL) != 0)
+            dieWithError("[ERROR] Failed to create I/O thread");
+    }
+    read_pool.threadCount = threadCount;
+}
+
+/* Called once the reactors are gone; queued jobs are still run first. */
+void stopReadPool(void) {
+    pthread_mutex_lock(&read_pool.mutex);
+    read_pool.stopping = 1;
+    pthread_cond_broadcast(&read_pool.notEmpty);
+    pthread_mutex_unlock(&read_pool.mutex);
+    
+    for (int i = 0; i < read_pool.threadCount; i++)
+        pthread_join(read_pool.threads[i], NULL);
+    free(read_pool.threads);
+}
+
+void initReadCompletions(ReadCompletions *completions) {
+    pthread_mutex_init(&completions->mutex, NULL);
+    completions->done = NULL;
+    completions->eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (completions->eventFd < 0)
+        dieWithError("[ERROR] eventfd error");
+}
 
-typedef struct RequestInfo {
-    FILE *fp;
-    struct sockaddr_in addr;
-    int expectedBlockNumber;
-    unsigned int bigfile;
-    struct RequestInfo *next;
-} RequestInfo;
+/* A short file read marks the final block; a failed one ends the transfer. */
+void completeReadAhead(EventLoop *loop, ReadJob *job) {
+    Session *session = job->session;
+    
+    session->readPending = 0;
+    read_jobs_pending--;
+    if (session->released) {
+        destroySession(session);
+        return;
+    }
+    if (session->removed)
+        return;
+    
+    if (job->error != 0) {
+        errno = job->error;
+        perror("[ERROR] read error");
+        sendErrorPacket(session->sockfd, &session->addr, 0, "Read error");
+        removeSession(loop, session);
+        return;
+    }
+    
+    if (job->map != NULL) {
+        session->readIndex = job->first + job->count - 1;
+    } else {
+        long long full = job->result / session->blksize;
+        for (long long i = 0; i < full; i++)
+            session->windowLengths[(job->first + i) % session->ringSize] = session->blksize;
+        session->readIndex = job->first + full - 1;
+        if (full < job->count) {
+            session->windowLengths[(job->first + full) % session->ringSize] = job->result % session->blksize;
+            session->readIndex = job->first + full;
+            session->lastBlock = session->readIndex;
+        }
+    }
+    
+    /* A RRQ answered with an OACK sends nothing before ACK 0. */
+    if (session->base > 0)
+        fillWindow(session);
+    else
+        scheduleReadAhead(session);
+}
 
-typedef struct Client {
-    int sockfd;
-    struct sockaddr_in addr;
-    FILE *fp;
-    struct Client *next;
-} Client;
+void onReadAheadDone(EventLoop *loop, Handler *handler) {
+    ReadCompletions *completions = handler->data;
+    uint64_t count;
+    
+    if (read(completions->eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("[ERROR] eventfd read error");
+    
+    pthread_mutex_lock(&completions->mutex);
+    ReadJob *job = completions->done;
+    completions->done = NULL;
+    pthread_mutex_unlock(&completions->mutex);
+    
+    while (job != NULL) {
+        ReadJob *next = job->next;
+        completeReadAhead(loop, job);
+        job = next;
+    }
+}
 
-RequestInfo *request_list = NULL;
-Client *client_list = NULL;
+int rtoMs(Session *session) {
+    return (int)((session->rtt.rto + 999) / 1000);
+}
 
-void dieWithError(char *errorMessage);
-RequestInfo *findRequest(struct sockaddr_in addr);
-void removeRequest(RequestInfo *request);
-void addClient(int sockfd, struct sockaddr_in addr, FILE *fp);
-Client *findClient(struct sockaddr_in addr);
-void removeClient(Client *client);
-void addRequest(FILE *fp, struct sockaddr_in addr, int expectedBlockNumber, unsigned int bigfile);
-void handleRequest(int sockfd, fd_set *master_fds, int *max_fd);
+Session *addSession(EventLoop *loop, struct sockaddr_in addr, int fileFd, CachedFile *cached, int isRead, RequestOptions *options, uint32_t requestHash) {
+    Session *existing = sessionLookup(&session_table, addr);
+    if (existing != NULL) {
+        LOG(LOG_WARNING, "event=transfer_replaced peer=%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+        removeSession(loop, existing);
+    }
+    
+    int sockfd = openTransferSocket();
+    if (sockfd < 0) {
+        perror("[ERROR] transfer socket error");
+        return NULL;
+    }
+    
+    Session *new_session = poolGet(&session_pool);
+    if (new_session == NULL) {
+        close(sockfd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(new_session, 0, sizeof(Session));
+    new_session->addr = addr;
+    new_session->sockfd = sockfd;
+    new_session->fileFd = fileFd;
+    new_session->isRead = isRead;
+    new_session->options = *options;
+    new_session->requestHash = requestHash;
+    new_session->bigfile = options->bigfile;
+    new_session->blksize = options->blksize ? options->blksize : DEFAULT_BLKSIZE;
+    new_session->windowsize = options->windowsize ? options->windowsize : 1;
+    new_session->base = 1;
+    new_session->next = 1;
+    new_session->nextClosing = NULL;
+    new_session->handler.fd = sockfd;
+    new_session->handler.callback = onSessionReadable;
+    new_session->handler.data = new_session;
+    new_session->timer.callback = onSessionTimeout;
+    new_session->timer.data = new_session;
+    rttInit(&new_session->rtt);
+    new_session->rttIndex = -1;
+    new_session->lastAckSent = -1;
+    
+    /* A receiver must be able to queue a whole window; the kernel caps the
+       request at net.core.rmem_max. */
+    if (!isRead && new_session->windowsize > 1) {
+        size_t wanted = (size_t)new_session->windowsize * (4 + new_session->blksize) * 2;
+        int rcvbuf = wanted > INT_MAX ? INT_MAX : (int)wanted;
+        int current;
+        socklen_t len = sizeof(current);
+        if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &current, &len) == 0 && current < rcvbuf)
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    
+    /* Only the sender keeps a copy of the blocks in flight, and none at all when
+       the file is mapped. The mapping size gives the final block up front: the
+       first one shorter than blksize, possibly empty. */
+    if (cached != NULL) {
+        new_session->cached = cached;
+        new_session->map = cached->map;
+        new_session->mapSize = cached->size;
+        new_session->lastBlock = cached->size / new_session->blksize + 1;
+    } else if (isRead) {
+        new_session->ringSize = new_session->windowsize + readahead_blocks;
+        new_session->seekable = lseek(fileFd, 0, SEEK_CUR) >= 0;
+        new_session->window = bufferGet(&buffer_pool, windowBytes(new_session));
+        new_session->windowLengths = bufferGet(&buffer_pool, new_session->ringSize * sizeof(int));
+        if (new_session->window == NULL || new_session->windowLengths == NULL) {
+            if (new_session->window != NULL)
+                bufferPut(&buffer_pool, new_session->window, windowBytes(new_session));
+            if (new_session->windowLengths != NULL)
+                bufferPut(&buffer_pool, new_session->windowLengths, new_session->ringSize * sizeof(int));
+            poolPut(&session_pool, new_session);
+            close(sockfd);
+            errno = ENOMEM;
+            return NULL;
+        }
+    } else if (!isRead) {
+        size_t capacity = writeBehindCapacity(options->tsize);
+        char *buffer = bufferGet(&buffer_pool, capacity);
+        if (buffer == NULL) {
+            poolPut(&session_pool, new_session);
+            close(sockfd);
+            errno = ENOMEM;
+            return NULL;
+        }
+        writeBehindInit(&new_session->writer, fileFd, buffer, capacity, options->tsize);
+    }
+    
+    /* The caller still owns the file when the table cannot take the session. */
+    if (sessionInsert(&session_table, addr, new_session) < 0) {
+        new_session->fileFd = -1;
+        new_session->cached = NULL;
+        destroySession(new_session);
+        errno = ENOSPC;
+        return NULL;
+    }
+    new_session->startedAt = monotonicUs();
+    metricAdd(&reactor_metrics->sessionsStarted, 1);
+    watchFd(loop, &new_session->handler);
+    armTimer(loop, &new_session->timer, rtoMs(new_session));
+    
+    /* Start reading while the OACK or the first window is on its way. */
+    if (isRead)
+        scheduleReadAhead(new_session);
+    return new_session;
+}
 
-void dieWithError(char *errorMessage) {
-    perror(errorMessage);
-    exit(EXIT_FAILURE);
+/* File bytes moved so far: written for a WRQ; for a RRQ, the whole file once
+   its last block is known, which is all the metrics ask for. */
+long long transferBytes(Session *session) {
+    if (!session->isRead)
+        return session->writer.offset + session->writer.used;
+    if (session->map != NULL)
+        return session->mapSize;
+    if (session->lastBlock == 0)
+        return 0;
+    return (session->lastBlock - 1) * session->blksize + session->windowLengths[session->lastBlock % session->ringSize];
 }
 
-void addRequest(FILE *fp, struct sockaddr_in addr, int expectedBlockNumber, unsigned int bigfile) {
-    RequestInfo *new_request = malloc(sizeof(RequestInfo));
-    new_request->fp = fp;
-    new_request->addr = addr;
-    new_request->expectedBlockNumber = expectedBlockNumber;
-    new_request->bigfile = bigfile;
-    new_request->next = request_list;
-    request_list = new_request;
+/* The socket and the record are released by releaseClosedSessions() once the
+   packets still queued for them have been flushed. */
+void removeSession(EventLoop *loop, Session *session) {
+    long long micros = monotonicUs() - session->startedAt;
+    metricsEndSession(reactor_metrics, session->completed, micros, transferBytes(session));
+    if (session->completed)
+        histogramRecord(&reactor_latency->transfer, micros);
+    session->removed = 1;
+    unwatchFd(loop, &session->handler);
+    cancelTimer(loop, &session->timer);
+    sessionRemove(&session_table, session->addr);
+    session->nextClosing = closing_sessions;
+    closing_sessions = session;
 }
-RequestInfo *findRequest(struct sockaddr_in addr) {
-    RequestInfo *current = request_list;
-    while (current != NULL) {
-        if (current->addr.sin_addr.s_addr == addr.sin_addr.s_addr && current->addr.sin_port == addr.sin_port) {
-            return current;
+
+void destroySession(Session *session) {
+    /* An interrupted upload leaves the target as it was; one written in place
+       (a pipe, a device) keeps what was received. */
+    if (session->writer.buffer != NULL) {
+        if (session->uploadPath == NULL) {
+            if (writeBehindFlush(&session->writer) < 0)
+                perror("[ERROR] write error");
+            writeBehindRelease(&session->writer);
         }
-        current = current->next;
+        bufferPut(&buffer_pool, session->writer.buffer, session->writer.capacity);
     }
-    return NULL;
+    if (session->uploadPath != NULL) {
+        unlink(session->uploadPath);
+        bufferPut(&buffer_pool, session->uploadPath, session->pathBytes);
+    }
+    close(session->sockfd);
+    if (session->fileFd >= 0)
+        close(session->fileFd);
+    if (session->cached != NULL)
+        releaseCachedFile(session->cached);
+    if (session->window != NULL) {
+        bufferPut(&buffer_pool, session->window, windowBytes(session));
+        bufferPut(&buffer_pool, session->windowLengths, session->ringSize * sizeof(int));
+    }
+    poolPut(&session_pool, session);
 }
 
-void removeRequest(RequestInfo *request) {
-    if (request_list == request) {
-        request_list = request->next;
-    } else {
-        RequestInfo *current = request_list;
-        while (current->next != request) {
-            current = current->next;
+/* A session whose read-ahead is still running is left to onReadAheadDone(). */
+void releaseClosedSessions(void) {
+    while (closing_sessions != NULL) {
+        Session *session = closing_sessions;
+        closing_sessions = session->nextClosing;
+        if (session->readPending)
+            session->released = 1;
+        else
+            destroySession(session);
+    }
+}
+
+/* Read-ahead jobs only leave once the tx queue is flushed: until then a ring
+   slot they overwrite may still be queued for a retransmission. */
+void flushPendingIO(EventLoop *loop) {
+    (void)loop;
+    flushTxQueue();
+    submitReadAheads();
+    releaseClosedSessions();
+}
+
+/* Options are answered as "name\0value\0" pairs (RFC 2347), leaving out the
+   ones that were not requested. */
+int createOackPacket(char *oackPacket, int capacity, RequestOptions *options) {
+    int offset = packOpcode(oackPacket, capacity, OP_OACK);
+    if (options->bigfile)
+        offset = packOption(oackPacket, capacity, offset, "bigfile", options->bigfile);
+    if (options->blksize)
+        offset = packOption(oackPacket, capacity, offset, "blksize", options->blksize);
+    if (options->windowsize)
+        offset = packOption(oackPacket, capacity, offset, "windowsize", options->windowsize);
+    if (options->tsize >= 0)
+        offset = packOption(oackPacket, capacity, offset, "tsize", options->tsize);
+    return offset;
+}
+
+/* Reads the options of a parsed RRQ/WRQ. "bigfile" is accepted whatever its
+   value; blksize (RFC 2348) and windowsize (RFC 7440) are clamped to what this
+   server accepts; unknown or malformed options are left out of the OACK. */
+void parseRequestOptions(const RequestPacket *request, RequestOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->tsize = -1;
+    
+    for (int i = 0; i < request->optionCount; i++) {
+        StrView name = request->options[i].name;
+        long long requested = viewToNumber(request->options[i].value);
+        
+        if (viewIs(name, "bigfile")) {
+            options->bigfile = 1;
+        } else if (viewIs(name, "blksize")) {
+            if (requested >= MIN_BLKSIZE)
+                options->blksize = requested < max_blksize ? requested : max_blksize;
+        } else if (viewIs(name, "windowsize")) {
+            if (requested >= 1 && requested <= MAX_WINDOWSIZE)
+                options->windowsize = requested < max_windowsize ? requested : max_windowsize;
+        } else if (viewIs(name, "tsize")) {
+            if (requested >= 0)
+                options->tsize = requested;
         }
-        current->next = request->next;
     }
-    free(request);
 }
 
-void addClient(int sockfd, struct sockaddr_in addr, FILE *fp) {
-    Client *new_client = malloc(sizeof(Client));
-    new_client->sockfd = sockfd;
-    new_client->addr = addr;
-    new_client->fp = fp;
-    new_client->next = client_list;
-    client_list = new_client;
+void startRttSample(Session *session, long long index) {
+    session->rttIndex = index;
+    session->rttStart = monotonicUs();
+}
+
+/* Called for every DATA block put on the wire. A block sent again is counted,
+   and the sample is dropped if its ACK could now answer either copy (Karn). */
+void trackSent(Session *session, long long index) {
+    if (index > session->highestSent) {
+        session->highestSent = index;
+        if (session->rttIndex < 0)
+            startRttSample(session, index);
+        return;
+    }
+    session->retransmits++;
+    metricAdd(&reactor_metrics->retransmits, 1);
+    if (index > session->resentThrough)
+        session->resentThrough = index;
+    if (session->rttIndex >= index)
+        session->rttIndex = -1;
+}
+
+void completeRttSample(Session *session, long long index) {
+    if (session->rttIndex >= 0 && index >= session->rttIndex) {
+        long long sample = monotonicUs() - session->rttStart;
+        rttSample(&session->rtt, sample);
+        histogramRecord(&reactor_latency->blockRtt, sample);
+        session->rttIndex = -1;
+    }
+}
+
+/* Time from the request to the first block acknowledged (RRQ) or received (WRQ). */
+void timeFirstBlock(Session *session) {
+    if (!session->firstBlockTimed) {
+        histogramRecord(&reactor_latency->setup, monotonicUs() - session->startedAt);
+        session->firstBlockTimed = 1;
+    }
+}
+
+void printTransferStats(Session *session) {
+    long long blocks = session->isRead ? session->highestSent : session->base - 1;
+    LOG(LOG_INFO, "event=transfer_stats peer=%s:%d blocks=%lld retransmits=%lu srtt_ms=%.2f rto_ms=%.2f", inet_ntoa(session->addr.sin_addr),
+        ntohs(session->addr.sin_port), blocks, session->retransmits, session->rtt.srtt / 1000.0, session->rtt.rto / 1000.0);
+}
+
+char *windowPacket(Session *session, long long index) {
+    return session->window + (size_t)(index % session->ringSize) * (4 + session->blksize);
 }
 
-Client *findClient(struct sockaddr_in addr) {
-    Client *current = client_list;
-    while (current != NULL) {
-        if (current->addr.sin_addr.s_addr == addr.sin_addr.s_addr && current->addr.sin_port == addr.sin_port) {
-            return current;
+/* Sends every block of the current window that has not been sent yet and is
+   already in memory; the rest goes out when its read-ahead completes. */
+void fillWindow(Session *session) {
+    while (session->next < session->base + session->windowsize) {
+        if (session->lastBlock != 0 && session->next > session->lastBlock)
+            break;
+        if (session->next > session->readIndex) {
+            scheduleReadAhead(session);
+            if (session->next > session->readIndex)
+                break;
+        }
+        
+        int slot = session->next % session->ringSize;
+        int block = wireBlock(session->next, session->bigfile);
+        
+        if (session->map != NULL) {
+            char header[4];
+            size_t offset = (size_t)(session->next - 1) * session->blksize;
+            size_t len = offset < session->mapSize ? session->mapSize - offset : 0;
+            if (len > (size_t)session->blksize)
+                len = session->blksize;
+            
+            header[0] = 0;
+            header[1] = 3;
+            header[2] = (block >> 8) & 0xFF;
+            header[3] = block & 0xFF;
+            queueDataPacket(session->sockfd, &session->addr, header, session->map + offset, len);
+            trackSent(session, session->next);
+            session->next++;
+            continue;
         }
-        current = current->next;
+        
+        char *packet = windowPacket(session, session->next);
+        packet[0] = 0;
+        packet[1] = 3;
+        packet[2] = (block >> 8) & 0xFF;
+        packet[3] = block & 0xFF;
+        queuePacket(session->sockfd, &session->addr, packet, session->windowLengths[slot] + 4, 0);
+        trackSent(session, session->next);
+        session->next++;
     }
-    return NULL;
+    
+    scheduleReadAhead(session);
+}
+
+void sendAck(Session *session, long long index) {
+    char ackPacket[4];
+    int block = wireBlock(index, session->bigfile);
+    ackPacket[0] = 0;
+    ackPacket[1] = 4;
+    ackPacket[2] = (block >> 8) & 0xFF;
+    ackPacket[3] = block & 0xFF;
+    queuePacket(session->sockfd, &session->addr, ackPacket, sizeof(ackPacket), 1);
+    session->sinceAck = 0;
+    
+    /* A WRQ is timed from a new ACK to the block that follows it. */
+    if (index > session->lastAckSent) {
+        session->lastAckSent = index;
+        if (session->rttIndex < 0)
+            startRttSample(session, index + 1);
+    } else {
+        session->retransmits++;
+        metricAdd(&reactor_metrics->retransmits, 1);
+        if (session->rttIndex == index + 1)
+            session->rttIndex = -1;
+    }
+}
+
+void sendOack(Session *session) {
+    char oackPacket[MAX_OACK_SIZE];
+    int oackPacketLen = createOackPacket(oackPacket, MAX_OACK_SIZE, &session->options);
+    queuePacket(session->sockfd, &session->addr, oackPacket, oackPacketLen, 1);
+}
+
+int hasOptions(Session *session) {
+    return session->options.bigfile || session->options.blksize || session->options.windowsize || session->options.tsize >= 0;
+}
+
+/* The peer answered: give it a fresh timeout and a fresh retry budget. */
+void sessionProgress(EventLoop *loop, Session *session) {
+    session->retries = 0;
+    rttProgress(&session->rtt);
+    armTimer(loop, &session->timer, rtoMs(session));
+}
+
+/* Resends what the peer is missing: the OACK if it was never acknowledged, the
+   last ACK for a WRQ, or the whole window from the first unacknowledged block. */
+void onSessionTimeout(EventLoop *loop, Timer *timer) {
+    Session *session = timer->data;
+    
+    metricAdd(&reactor_metrics->timeouts, 1);
+    session->retries++;
+    session->rttIndex = -1;
+    rttBackoff(&session->rtt);
+    if (rttExpired(&session->rtt, session->retries, MAX_RETRIES)) {
+        LOG(LOG_ERROR, "event=transfer_timeout peer=%s:%d", inet_ntoa(session->addr.sin_addr), ntohs(session->addr.sin_port));
+        printTransferStats(session);
+        sendErrorPacket(session->sockfd, &session->addr, 0, "Transfer timed out");
+        removeSession(loop, session);
+        return;
+    }
+    
+    LOG(LOG_INFO, "event=retransmit peer=%s:%d attempt=%d rto_ms=%d", inet_ntoa(session->addr.sin_addr), ntohs(session->addr.sin_port), session->retries, rtoMs(session));
+    if (session->isRead && session->base == 0) {
+        sendOack(session);
+        session->retransmits++;
+        metricAdd(&reactor_metrics->retransmits, 1);
+    } else if (session->isRead) {
+        session->next = session->base;
+        fillWindow(session);
+    } else if (session->base == 1 && hasOptions(session)) {
+        sendOack(session);
+        session->retransmits++;
+        metricAdd(&reactor_metrics->retransmits, 1);
+    } else {
+        sendAck(session, session->base - 1);
+    }
+    armTimer(loop, timer, rtoMs(session));
+}
+
+/* Answers a request the client sent again because our first answer got lost,
+   as the timer would. Once the transfer has moved on, the copy is ignored. */
+void answerRepeatedRequest(Session *session) {
+    session->rttIndex = -1;
+    if (session->base == (session->isRead ? 0 : 1) && hasOptions(session)) {
+        sendOack(session);
+        session->retransmits++;
+        metricAdd(&reactor_metrics->retransmits, 1);
+    } else if (session->isRead && session->base == 1) {
+        session->next = session->base;
+        fillWindow(session);
+    } else if (!session->isRead && session->base == 1) {
+        sendAck(session, 0);
+    }
+}
+
+/* Opens the file a WRQ writes to. A regular file, or a new one, is uploaded
+   into a temporary file in the same directory, whose name goes to *uploadPath
+   (pathBytes bytes from the buffer pool, followed by a copy of the target
+   name); commitUpload() renames it into place. Anything else is written in
+   place. */
+int openUpload(const char *filename, char **uploadPath, size_t *pathBytes) {
+    static unsigned long upload_serial;
+    struct stat st;
+    
+    *uploadPath = NULL;
+    int exists = stat(filename, &st) == 0;
+    if (exists && !S_ISREG(st.st_mode))
+        return open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    
+    const char *slash = strrchr(filename, '/');
+    int dirLength = slash != NULL ? (int)(slash + 1 - filename) : 0;
+    size_t nameLength = strlen(filename);
+    size_t tempBytes = nameLength + 64;
+    char *path = bufferGet(&buffer_pool, tempBytes + nameLength + 1);
+    if (path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    int fd;
+    do {
+        unsigned long serial = __atomic_fetch_add(&upload_serial, 1, __ATOMIC_RELAXED);
+        snprintf(path, tempBytes, "%.*s.%s.%d.%lu.part", dirLength, filename, filename + dirLength, (int)getpid(), serial);
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    } while (fd < 0 && errno == EEXIST);
+    if (fd < 0) {
+        int saved = errno;
+        bufferPut(&buffer_pool, path, tempBytes + nameLength + 1);
+        errno = saved;
+        return -1;
+    }
+    
+    /* A replaced file keeps its permissions, as it did when truncated. */
+    if (exists)
+        fchmod(fd, st.st_mode & 07777);
+    memcpy(path + tempBytes, filename, nameLength + 1);
+    *uploadPath = path;
+    *pathBytes = tempBytes + nameLength + 1;
+    return fd;
+}
+
+/* Replaces the target with the completed upload. */
+int commitUpload(Session *session) {
+    if (session->uploadPath == NULL)
+        return 0;
+    if (rename(session->uploadPath, session->targetPath) < 0)
+        return -1;
+    bufferPut(&buffer_pool, session->uploadPath, session->pathBytes);
+    session->uploadPath = NULL;
+    return 0;
 }
 
-void removeClient(Client *client) {
-    if (client_list == client) {
-        client_list = client->next;
+void handleRequest(EventLoop *loop, int sockfd, char *buffer, int n, struct sockaddr_in addr) {
+    int fileFd = -1;
+    char *uploadPath = NULL;
+    size_t pathBytes = 0;
+    
+    LOG(LOG_INFO, "event=request peer=%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+    
+    int opcode = packetOpcode(buffer, n);
+    if (opcode != OP_RRQ && opcode != OP_WRQ) {
+        sendErrorPacket(sockfd, &addr, 5, "Unknown transfer ID");
+        return;
+    }
+    
+    /* The same request from the same port is a retransmission, not a new
+       transfer: restarting would truncate the upload or rewind the download. */
+    uint32_t requestHash = 2166136261u;
+    for (int i = 0; i < n; i++)
+        requestHash = (requestHash ^ (unsigned char)buffer[i]) * 16777619u;
+    Session *existing = sessionLookup(&session_table, addr);
+    if (existing != NULL && existing->requestHash == requestHash) {
+        answerRepeatedRequest(existing);
+        return;
+    }
+    
+    RequestPacket request;
+    if (parseRequest(buffer, n, &request) < 0) {
+        LOG(LOG_ERROR, "event=malformed_request peer=%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+        sendErrorPacket(sockfd, &addr, 4, "Illegal TFTP operation");
+        return;
+    }
+    RequestOptions options;
+    parseRequestOptions(&request, &options);
+    
+    /* The filename view is NUL-terminated inside the packet. */
+    const char *filename = request.filename.data;
+    
+    /* Only files the cache cannot map (empty, not regular) go through stdio. */
+    CachedFile *cached = NULL;
+    if (opcode == OP_RRQ)
+        cached = acquireCachedFile(filename);
+    if (opcode == OP_WRQ)
+        fileFd = openUpload(filename, &uploadPath, &pathBytes);
+    else if (cached == NULL)
+        fileFd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (cached == NULL && fileFd < 0) {
+        perror("[ERROR] Cannot open file");
+        sendErrorPacket(sockfd, &addr, opcode == OP_WRQ ? 2 : 1, opcode == OP_WRQ ? "Cannot create file" : "File not found");
+        return;
+    }
+    
+    /* A RRQ learns the size when it can be known; a pipe drops the option. */
+    struct stat st;
+    if (opcode == OP_RRQ && options.tsize >= 0) {
+        if (cached != NULL)
+            options.tsize = cached->size;
+        else
+            options.tsize = fstat(fileFd, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : -1;
+    }
+    
+    /* A window too large to allocate, or a session table that cannot grow,
+       only costs this client its transfer. */
+    Session *session = addSession(loop, addr, fileFd, cached, opcode == OP_RRQ, &options, requestHash);
+    if (session == NULL) {
+        int allocationFailed = errno == ENOMEM;
+        if (fileFd >= 0)
+            close(fileFd);
+        if (cached != NULL)
+            releaseCachedFile(cached);
+        if (uploadPath != NULL) {
+            unlink(uploadPath);
+            bufferPut(&buffer_pool, uploadPath, pathBytes);
+        }
+        if (allocationFailed)
+            sendErrorPacket(sockfd, &addr, 3, "Disk full or allocation exceeded");
+        else
+            sendErrorPacket(sockfd, &addr, 0, "Server busy");
+        return;
+    }
+    if (uploadPath != NULL) {
+        session->uploadPath = uploadPath;
+        session->targetPath = uploadPath + pathBytes - strlen(filename) - 1;
+        session->pathBytes = pathBytes;
+    }
+    
+    if (hasOptions(session)) {
+        sendOack(session);
+        startRttSample(session, session->isRead ? 0 : 1);
+        
+        /* A RRQ answered with an OACK waits for ACK 0 before the first window. */
+        if (session->isRead)
+            session->base = 0;
+    } else if (!session->isRead) {
+        sendAck(session, 0);
     } else {
-        Client *current = client_list;
-        while (current->next != client) {
-            current = current->next;
+        fillWindow(session);
+    }
+}
+
+/* Reports a failed write to the client and drops the transfer. */
+int abortWrite(EventLoop *loop, Session *session) {
+    perror("[ERROR] write error");
+    sendErrorPacket(session->sockfd, &session->addr, 3, "Disk full or allocation exceeded");
+    removeSession(loop, session);
+    return -1;
+}
+
+/* RFC 7440 receiver: ACK the last block of each window, the final block, and
+   the last in-order block when a gap or a duplicate shows the sender is out of
+   step with us. */
+int handleDataPacket(EventLoop *loop, Session *session, char *buffer, int n) {
+    int block = (unsigned char)buffer[2] << 8 | (unsigned char)buffer[3];
+    
+    if (block != wireBlock(session->base, session->bigfile)) {
+        long long previous = blockIndex(block, session->base - session->windowsize, session->base - 1, session->bigfile);
+        if (previous >= 0) {
+            sendAck(session, session->base - 1);
+        } else if (!session->gapAcked) {
+            sendAck(session, session->base - 1);
+            session->gapAcked = 1;
         }
-        current->next = client->next;
+        return 0;
+    }
+    
+    if (n > 4 && writeBehindAppend(&session->writer, buffer + 4, n - 4) < 0)
+        return abortWrite(loop, session);
+    completeRttSample(session, session->base);
+    timeFirstBlock(session);
+    session->base++;
+    session->sinceAck++;
+    session->gapAcked = 0;
+    sessionProgress(loop, session);
+    
+    /* The final ACK is only sent once the whole file is written. */
+    if (n - 4 < session->blksize) {
+        if (writeBehindFlush(&session->writer) < 0 || commitUpload(session) < 0)
+            return abortWrite(loop, session);
+        sendAck(session, session->base - 1);
+        LOG(LOG_INFO, "event=transfer_done peer=%s:%d op=wrq", inet_ntoa(session->addr.sin_addr), ntohs(session->addr.sin_port));
+        printTransferStats(session);
+        session->completed = 1;
+        removeSession(loop, session);
+        return -1;
+    }
+    
+    if (session->sinceAck >= session->windowsize)
+        sendAck(session, session->base - 1);
+    return 0;
+}
+
+/* RFC 7440 sender: an ACK slides the window to the block after it. An ACK in
+   the middle of the window, or a first duplicate ACK, restarts sending from the
+   block after the one acknowledged. */
+int handleAckPacket(EventLoop *loop, Session *session, char *buffer) {
+    int block = (unsigned char)buffer[2] << 8 | (unsigned char)buffer[3];
+    long long index = blockIndex(block, session->base - 1, session->next - 1, session->bigfile);
+    
+    if (index < 0)
+        return 0;
+    
+    LOG_SAMPLED(LOG_DEBUG, "event=ack peer=%s:%d block=%d", inet_ntoa(session->addr.sin_addr), ntohs(session->addr.sin_port), block);
+    completeRttSample(session, index);
+    if (index >= 1)
+        timeFirstBlock(session);
+    
+    /* A duplicate ACK may only mean the peer saw one of our retransmissions:
+       that is always the case without a window (RFC 1123), or when the block it
+       acknowledges was sent twice. Answering it would send every block twice
+       from then on, so the retransmit timer deals with those. */
+    if (index == session->base - 1) {
+        metricAdd(&reactor_metrics->duplicateAcks, 1);
+        if (session->dupAckHandled || session->next == session->base || session->windowsize == 1 || index <= session->resentThrough)
+            return 0;
+        session->dupAckHandled = 1;
+    } else {
+        session->dupAckHandled = 0;
+    }
+    
+    if (session->lastBlock != 0 && index == session->lastBlock) {
+        LOG(LOG_INFO, "event=transfer_done peer=%s:%d op=rrq", inet_ntoa(session->addr.sin_addr), ntohs(session->addr.sin_port));
+        printTransferStats(session);
+        session->completed = 1;
+        removeSession(loop, session);
+        return -1;
     }
-    free(client);
+    
+    session->base = index + 1;
+    session->next = session->base;
+    sessionProgress(loop, session);
+    fillWindow(session);
+    return 0;
 }
 
-void createOackPacket(char *oackPacket, int *oackPacketLen, unsigned int bigfile) {
-    oackPacket[0] = 0;
-    oackPacket[1] = 6;
-    int offset = 2;
-    if (bigfile) {
-        strcpy(&oackPacket[offset], "bigfile");
-        offset += strlen("bigfile") + 1;
-        memcpy(&oackPacket[offset], &bigfile, sizeof(bigfile));
-        offset += sizeof(bigfile);
+/* Returns -1 once the session has been removed. */
+int handleSessionPacket(EventLoop *loop, Session *session, char *buffer, int n) {
+    if (n < 4)
+        return 0;
+    
+    if (buffer[1] == 3 && !session->isRead) {
+        return handleDataPacket(loop, session, buffer, n);
+    } else if (buffer[1] == 4 && session->isRead) {
+        return handleAckPacket(loop, session, buffer);
+    } else if (buffer[1] == 5) {
+        LOG(LOG_ERROR, "event=client_abort peer=%s:%d message=\"%.*s\"", inet_ntoa(session->addr.sin_addr), ntohs(session->addr.sin_port), n - 4, buffer + 4);
+        removeSession(loop, session);
+        return -1;
     }
-    *oackPacketLen = offset;
+    return 0;
 }
 
-void handleRequest(int sockfd, fd_set *master_fds, int *max_fd) {
-    char buffer[SIZE];
+/* Both the server socket and the transfer sockets are non-blocking: drain every
+   queued datagram so that an edge-triggered backend does not miss packets that
+   arrived together. A short batch means the receive queue is empty. */
+void onSessionReadable(EventLoop *loop, Handler *handler) {
+    Session *session = handler->data;
     int n;
-    struct sockaddr_in addr;
-    socklen_t addr_size = sizeof(addr);
-    char ackPacket[4];
-    ackPacket[0] = 0;
-    ackPacket[1] = 4;
-    ackPacket[2] = 0;
-    ackPacket[3] = 0;
-    int readBytes, retries;
-    RequestInfo *request;
     
-    char *filename = NULL;
-    FILE *fp = NULL;
-    FD_SET(sockfd, master_fds);
-    *max_fd = sockfd;
+    do {
+        n = receiveBatch(handler->fd);
+        for (int i = 0; i < n; i++) {
+            struct sockaddr_in *addr = &rx_batch.addrs[i];
+            
+            if (addr->sin_addr.s_addr != session->addr.sin_addr.s_addr || addr->sin_port != session->addr.sin_port) {
+                sendErrorPacket(handler->fd, addr, 5, "Unknown transfer ID");
+                continue;
+            }
+            
+            if (handleSessionPacket(loop, session, batchBuffer(i), rx_batch.msgs[i].msg_len) < 0)
+                return;
+        }
+    } while (n == batch_size);
+}
+
+void onServerReadable(EventLoop *loop, Handler *handler) {
+    int n;
+    
+    do {
+        n = receiveBatch(handler->fd);
+        for (int i = 0; i < n; i++)
+            handleRequest(loop, handler->fd, batchBuffer(i), rx_batch.msgs[i].msg_len, rx_batch.addrs[i]);
+    } while (n == batch_size);
+}
+
+/* The index-th CPU this process may run on, wrapping around; -1 if unknown. */
+int reactorCpu(int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) == 0)
+        return -1;
+    
+    int remaining = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && remaining-- == 0)
+            return cpu;
+    }
+    return -1;
+}
+
+void onStopReadable(EventLoop *loop, Handler *handler) {
+    (void)handler;
+    loop->running = 0;
+}
+
+/* Ends the transfers still running when the reactor stops, then waits for
+   the read-ahead jobs that still own a session's window. A removal shifts a
+   later entry of the probe chain into the freed slot, so the slot is checked
+   again before moving on. */
+void closeAllSessions(EventLoop *loop) {
+    for (size_t slot = 0; slot <= session_table.mask; ) {
+        if (*sessionSlotKey(&session_table, slot) != 0)
+            removeSession(loop, *sessionSlotValue(&session_table, slot));
+        else
+            slot++;
+    }
+    flushPendingIO(loop);
+    
+    while (read_jobs_pending > 0) {
+        struct pollfd pfd = { read_completions->eventFd, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            dieWithError("[ERROR] poll error");
+        onReadAheadDone(loop, &read_completions->handler);
+    }
+}
+
+/* Drops every cached mapping; all sessions must be gone. */
+void destroyFileCache(void) {
+    file_cache.budget = 0;
+    evictCachedFiles();
+    if (file_cache.enabled)
+        close(file_cache.inotifyFd);
+}
+
+/* Every reactor binds its own socket to the server port; the kernel spreads
+   requests over them by 4-tuple hash, and each transfer then stays on the
+   reactor that accepted it. */
+void *runReactor(void *arg) {
+    Reactor *reactor = arg;
+    reactor_metrics = &reactor->metrics;
+    reactor_latency = &reactor->latency;
+    
+    if (reactor->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(reactor->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            LOG(LOG_WARNING, "event=pin_failed reactor=%d cpu=%d", reactor->index, reactor->cpu);
+    }
+    
+    int server_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server_sockfd < 0)
+        dieWithError("[ERROR] socket error");
+    
+    int reuse = 1;
+    if (setsockopt(server_sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+        dieWithError("[ERROR] SO_REUSEPORT error");
+    
+    if (bind(server_sockfd, (struct sockaddr *)&reactor->addr, sizeof(reactor->addr)) < 0)
+        dieWithError("[ERROR] bind error");
+    
+    if (setNonBlocking(server_sockfd) < 0)
+        dieWithError("[ERROR] fcntl error");
+    
+    if (sessionTableInit(&session_table) < 0)
+        dieWithError("[ERROR] session table init error");
+    
+    initBatchIO();
+    poolInit(&session_pool, sizeof(Session));
+    poolInit(&cached_file_pool, sizeof(CachedFile));
+    bufferPoolInit(&buffer_pool);
+    
+    EventLoop loop;
+    initEventLoop(&loop, reactor->backend);
+    loop.flush = flushPendingIO;
+    initFileCache(&loop, reactor->cacheBudget);
+    
+    Handler serverHandler;
+    serverHandler.fd = server_sockfd;
+    serverHandler.callback = onServerReadable;
+    serverHandler.data = NULL;
+    watchFd(&loop, &serverHandler);
+    
+    read_completions = &reactor->completions;
+    read_completions->handler.fd = read_completions->eventFd;
+    read_completions->handler.callback = onReadAheadDone;
+    read_completions->handler.data = read_completions;
+    watchFd(&loop, &read_completions->handler);
+    
+    Handler stopHandler;
+    stopHandler.fd = reactor->stopFd;
+    stopHandler.callback = onStopReadable;
+    stopHandler.data = NULL;
+    watchFd(&loop, &stopHandler);
+    
+    runEventLoop(&loop);
+    
+    closeAllSessions(&loop);
+    flockfile(stdout);
+    printf("[STATS] reactor %d (CPU %d):\n", reactor->index, reactor->cpu);
+    printBatchStats();
+    printFileCacheStats();
+    printPoolStats();
+    funlockfile(stdout);
+    
+    destroyFileCache();
+    loop.backend->destroy(&loop);
+    sessionTableDestroy(&session_table);
+    poolDestroy(&session_pool);
+    poolDestroy(&cached_file_pool);
+    bufferPoolDestroy(&buffer_pool);
+    destroyBatchIO();
+    close(server_sockfd);
+    return NULL;
+}
+
+int writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void *serveMetrics(void *arg) {
+    MetricsEndpoint *endpoint = arg;
+    char request[1024];
     
     while (1) {
+        int client = accept(endpoint->fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
         
-        fd_set read_fds = *master_fds;
-        
-        int activity = select(*max_fd + 1, &read_fds, NULL, NULL, NULL);
-        if (activity < 0)
-            dieWithError("[ERROR] select error");
+        /* The request itself does not matter, but it has to be read before
+           answering or closing would reset the connection. */
+        struct timeval tv = { 1, 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (recv(client, request, sizeof(request), 0) < 0) {
+            close(client);
+            continue;
+        }
         
+        char *body = NULL;
+        size_t bodyLen = 0;
+        FILE *out = open_memstream(&body, &bodyLen);
+        if (out == NULL) {
+            close(client);
+            continue;
+        }
+        formatMetrics(out, endpoint->metrics, endpoint->count);
+        fclose(out);
         
-        if (FD_ISSET(sockfd, &read_fds)) {
-            FILE *fp = NULL;
-            
-            n = recvfrom(sockfd, buffer, SIZE, 0, (struct sockaddr *)&addr, &addr_size);
-            if (n < 0)
-                dieWithError("[ERROR] recvfrom error");
-            
-            printf("[INFO] Message received from %s:%d\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-            printf("%s", buffer);
-            
-            
-            
-            
-            if (buffer[1] == 2) {
-                
-                char *filename = buffer + 2;
-                char* mode = filename + strlen(filename) + 1;
-                char* option = mode + strlen(mode) + 1;
-                ackPacket[2] = 0;
-                ackPacket[3] = 0;
-                
-                fp = fopen(filename, "wb");
-                if (fp == NULL)
-                    dieWithError("[ERROR] Cannot open file");
-                
-                
-                char *ptr = strstr(option, "bigfile");
-                if (ptr != 0) {
-                    
-                    int bigfile = 1;
-                    
-                    addRequest(fp, addr, 0, bigfile);
-                    
-                    Client *client = findClient(addr);
-                    if (client == NULL) {
-                        addClient(sockfd, addr, fp);
-                    }
-                    
-                    FD_SET(fileno(fp), master_fds);
-                    
-                    *max_fd = (fileno(fp) > *max_fd) ? fileno(fp) : *max_fd;
-                    
-                    char oackPacket[MAX_OACK_SIZE];
-                    memset(oackPacket, 0, MAX_OACK_SIZE);
-                    int oackPacketLen;
-                    createOackPacket(oackPacket, &oackPacketLen, bigfile);
-                    if (sendto(sockfd, oackPacket, oackPacketLen, 0, (struct sockaddr *)&addr, addr_size) < 0)
-                        dieWithError("[ERROR] sendto error");
-                    
-                } else {
-                    
-                    int bigfile = 0;
-                    
-                    addRequest(fp, addr, 0, bigfile);
-                    
-                    if (sendto(sockfd, ackPacket, sizeof(ackPacket), 0, (struct sockaddr *)&addr, addr_size) < 0)
-                        dieWithError("[ERROR] sendto error");
-                    
-                    Client *client = findClient(addr);
-                    if (client == NULL) {
-                        addClient(sockfd, addr, fp);
-                    }
-                    
-                    FD_SET(fileno(fp), master_fds);
-                    
-                    *max_fd = (fileno(fp) > *max_fd) ? fileno(fp) : *max_fd;
+        char header[160];
+        int headerLen = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", bodyLen);
+        if (writeAll(client, header, headerLen) == 0)
+            writeAll(client, body, bodyLen);
+        free(body);
+        close(client);
+    }
+    return NULL;
+}
+
+void startMetricsEndpoint(MetricsEndpoint *endpoint, int port, Reactor *reactors, int count) {
+    endpoint->metrics = calloc(count, sizeof(ServerMetrics *));
+    if (endpoint->metrics == NULL)
+        dieWithError("[ERROR] malloc error");
+    for (int i = 0; i < count; i++)
+        endpoint->metrics[i] = &reactors[i].metrics;
+    endpoint->count = count;
+    
+    endpoint->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (endpoint->fd < 0)
+        dieWithError("[ERROR] metrics socket error");
+    int reuse = 1;
+    setsockopt(endpoint->fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(endpoint->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(endpoint->fd, 16) < 0)
+        dieWithError("[ERROR] metrics endpoint error");
+    if (pthread_create(&endpoint->thread, NULL, serveMetrics, endpoint) != 0)
+        dieWithError("[ERROR] Failed to create metrics thread");
+}
+
+/* shutdown() wakes the accept() of the endpoint thread. */
+void stopMetricsEndpoint(MetricsEndpoint *endpoint) {
+    shutdown(endpoint->fd, SHUT_RDWR);
+    pthread_join(endpoint->thread, NULL);
+    close(endpoint->fd);
+    free(endpoint->metrics);
+}
+
+/* Every reactor's histograms merged; reactors keep recording meanwhile. */
+void printLatency(Reactor *reactors, int count) {
+    TransferLatency *merged = calloc(1, sizeof(TransferLatency));
+    if (merged == NULL)
+        return;
+    for (int i = 0; i < count; i++)
+        transferLatencyMerge(merged, &reactors[i].latency);
+    flockfile(stdout);
+    printTransferLatency(stdout, merged);
+    funlockfile(stdout);
+    fflush(stdout);
+    free(merged);
+}
+
+int main(int argc, char *argv[]) {
+    char *ip = server_ip;
+    int port = 8080;
+    const char *backendName = NULL;
+    size_t cacheMib = DEFAULT_FILE_CACHE_MIB;
+    int reactorCount = 1;
+    int ioThreads = DEFAULT_IO_THREADS;
+    int metricsPort = 0;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "p:b:n:B:w:m:r:a:i:M:l:")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                if (port < 1 || port > 65535) {
+                    fprintf(stderr, "[ERROR] Port must be between 1 and 65535\n");
+                    exit(EXIT_FAILURE);
                 }
-                
-                
-            } else if (buffer[1] == 3) {
-                
-                RequestInfo *request = findRequest(addr);
-                if (request == NULL) {
-                    printf("[WARNING] Request not found, ignoring data packet\n");
-                    continue;
+                break;
+            case 'b':
+                backendName = optarg;
+                break;
+            case 'n':
+                batch_size = atoi(optarg);
+                if (batch_size < 1 || batch_size > MAX_BATCH_SIZE) {
+                    fprintf(stderr, "[ERROR] Batch size must be between 1 and %d\n", MAX_BATCH_SIZE);
+                    exit(EXIT_FAILURE);
                 }
-                
-                fp = request->fp;
-                if (fwrite(buffer + 4, 1, n - 4, fp) < 1)
-                    dieWithError("[ERROR] fwrite error");
-                
-                ackPacket[2] = buffer[2];
-                ackPacket[3] = buffer[3];
-                
-                if (sendto(sockfd, ackPacket, sizeof(ackPacket), 0, (struct sockaddr *)&addr, addr_size) < 0)
-                    dieWithError("[ERROR] sendto error");
-                
-                if (n < 512) {
-                    printf("[SUCCESS] File received successfully.\n");
-                    fclose(fp);
-                    removeRequest(request);
-                    
-                    FD_CLR(fileno(fp), master_fds);
-                    break;
+                break;
+            case 'B':
+                max_blksize = atoi(optarg);
+                if (max_blksize < MIN_BLKSIZE || max_blksize > MAX_BLKSIZE) {
+                    fprintf(stderr, "[ERROR] Maximum blksize must be between %d and %d\n", MIN_BLKSIZE, MAX_BLKSIZE);
+                    exit(EXIT_FAILURE);
                 }
-                
-                
-            } else if (buffer[1] == 1) {
-                
-                printf("[INFO] Message received from %s:%d\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-                char *filename = buffer + 2;
-                char* mode = filename + strlen(filename) + 1;
-                char* option = mode + strlen(mode) + 1;
-                ackPacket[2] = 0;
-                ackPacket[3] = 0;
-                
-                fp = fopen(filename, "r");
-                if (fp == NULL)
-                    dieWithError("[ERROR] Cannot open file");
-                
-                char *ptr = strstr(option, "bigfile");
-                if (ptr != 0) {
-                    
-                    int bigfile = 1;
-                    
-                    
-                    addRequest(fp, addr, 0, bigfile);
-                    
-                    
-                    Client *client = findClient(addr);
-                    if (client == NULL) {
-                        addClient(sockfd, addr, fp);
-                    }
-                    
-                    
-                    char oackPacket[MAX_OACK_SIZE];
-                    memset(oackPacket, 0, MAX_OACK_SIZE);
-                    int oackPacketLen;
-                    createOackPacket(oackPacket, &oackPacketLen, bigfile);
-                    if (sendto(sockfd, oackPacket, oackPacketLen, 0, (struct sockaddr *)&addr, addr_size) < 0)
-                        dieWithError("[ERROR] sendto error");
-                    
-                    
-                    readBytes = fread(buffer + 4, 1, 512, fp);
-                    
-                    
-                    int expectedBlockNumber = 0;
-                    retries = 0;
-                    
-                    
-                    while (retries < MAX_RETRIES) {
-                        buffer[1] = 3;
-                        buffer[2] = (expectedBlockNumber >> 8) & 0xFF;
-                        buffer[3] = expectedBlockNumber & 0xFF;
-                        n = sendto(sockfd, buffer, readBytes + 4, 0, (struct sockaddr *) &addr, sizeof(addr));
-                        if (n < 0) {
-                            if (retries == MAX_RETRIES) {
-                                fclose(fp);
-                                dieWithError("[ERROR] sending block to the server after max retries.");
-                            }
-                            printf("[RETRY] Retrying sendto...\n");
-                            retries++;
-                            continue;
-                        }
-                        break;
-                    }
-                    
-                    memset(buffer, 0, SIZE);
-                } else {
-                    
-                    
-                    int bigfile = 0;
-                    
-                    
-                    addRequest(fp, addr, 0, bigfile);
-                    
-                    
-                    Client *client = findClient(addr);
-                    if (client == NULL) {
-                        addClient(sockfd, addr, fp);
-                    }
-                    
-                    
-                    readBytes = fread(buffer + 4, 1, 512, fp);
-                    int expectedBlockNumber = 0;
-                    retries = 0;
-                    
-                    while (retries < MAX_RETRIES) {
-                        buffer[1] = 3;
-                        buffer[2] = (expectedBlockNumber >> 8) & 0xFF;
-                        buffer[3] = expectedBlockNumber & 0xFF;
-                        n = sendto(sockfd, buffer, readBytes + 4, 0, (struct sockaddr *) &addr, sizeof(addr));
-                        if (n < 0) {
-                            if (retries == MAX_RETRIES) {
-                                fclose(fp);
-                                dieWithError("[ERROR] sending block to the server after max retries.");
-                            }
-                            printf("[RETRY] Retrying sendto...\n");
-                            retries++;
-                            continue;
-                        }
-                        break;
-                    }
-                    memset(buffer, 0, SIZE);
+                break;
+            case 'w':
+                max_windowsize = atoi(optarg);
+                if (max_windowsize < 1 || max_windowsize > MAX_WINDOWSIZE) {
+                    fprintf(stderr, "[ERROR] Maximum windowsize must be between 1 and %d\n", MAX_WINDOWSIZE);
+                    exit(EXIT_FAILURE);
                 }
-                
-                
-            } else if (buffer[1] == 4) {
-                
-                int receivedBlockNumber = (unsigned char)buffer[2] << 8 | (unsigned char)buffer[3];
-                
-                RequestInfo *request = findRequest(addr);
-                if (request != NULL && receivedBlockNumber == request->expectedBlockNumber) {
-                    
-                    
-                    
-                    printf("[INFO] Received ACK for block %d\n", receivedBlockNumber);
-                    readBytes = fread(buffer + 4, 1, 512, request->fp);
-                    retries = 0;
-                    
-                    while (retries < MAX_RETRIES) {
-                        if (request->expectedBlockNumber == 65355 && request->bigfile == 1) {
-                            request->expectedBlockNumber = 1;
-                        } else {
-                            request->expectedBlockNumber++;
-                        }
-                        buffer[1] = 3;
-                        buffer[2] = (request->expectedBlockNumber >> 8) & 0xFF;
-                        buffer[3] = request->expectedBlockNumber & 0xFF;
-                        n = sendto(sockfd, buffer, readBytes + 4, 0, (struct sockaddr *) &addr, sizeof(addr));
-                        if (n < 0) {
-                            if (retries == MAX_RETRIES) {
-                                fclose(request->fp);
-                                dieWithError("[ERROR] sending block to the server after max retries.");
-                            }
-                            printf("[RETRY] Retrying sendto...\n");
-                            retries++;
-                            continue;
-                        }
-                        break;
-                    }
-                    
-                    if (readBytes <= 0) {
-                        printf("[SUCCESS] File sent successfully.\n");
-                        fclose(request->fp);
-                        removeRequest(request);
-                    }
+                break;
+            case 'm':
+                cacheMib = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                reactorCount = atoi(optarg);
+                if (reactorCount < 0) {
+                    fprintf(stderr, "[ERROR] Reactor count must be positive, or 0 for one per CPU\n");
+                    exit(EXIT_FAILURE);
                 }
-            }
+                break;
+            case 'a':
+                readahead_blocks = atoi(optarg);
+                if (readahead_blocks < 1) {
+                    fprintf(stderr, "[ERROR] Read-ahead must be at least 1 block\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                ioThreads = atoi(optarg);
+                if (ioThreads < 1) {
+                    fprintf(stderr, "[ERROR] At least one I/O thread is needed\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'M':
+                metricsPort = atoi(optarg);
+                if (metricsPort < 1 || metricsPort > 65535) {
+                    fprintf(stderr, "[ERROR] Metrics port must be between 1 and 65535\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                if (logConfigure(optarg) < 0) {
+                    fprintf(stderr, "[ERROR] Log level must be error, warning, info or debug, optionally followed by /sample_every\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-b epoll|select|io_uring] [-n batch_size] [-B max_blksize] [-w max_windowsize] [-m cache_mib] [-r reactors] [-a readahead_blocks] [-i io_threads] [-M metrics_port] [-l level[/sample_every]]\n", argv[0]);
+                exit(EXIT_FAILURE);
         }
     }
-}
-
-int main() {
-    char *ip = "127.0.0.1";
-    int port = 8080;
     
-    int server_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (server_sockfd < 0)
-        dieWithError("[ERROR] socket error");
+    const EventBackend *backend = findBackend(backendName);
+    if (backend == NULL) {
+        fprintf(stderr, "[ERROR] Unknown event backend: %s\n", backendName);
+        exit(EXIT_FAILURE);
+    }
+    if (backend == &uringBackend && !uringAvailable()) {
+        printf("[WARNING] io_uring is not available (%s), falling back to epoll\n", strerror(errno));
+        backend = &epollBackend;
+    }
     
     struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(port);
     server_addr.sin_addr.s_addr = inet_addr(ip);
     
+    if (reactorCount == 0)
+        reactorCount = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
     sa.sa_handler = SIG_IGN;
     sigaction(SIGPIPE, &sa, NULL);
     
-    if (bind(server_sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-        dieWithError("[ERROR] bind error");
+    /* Reactors never see SIGINT/SIGTERM: the main thread waits for them and
+       wakes every loop through the stop eventfd. SIGUSR1 prints the latency
+       histograms. */
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
     
-    printf("[STARTING] UDP File Server started on %s:%d.\n\n", ip, port);
+    int stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stopFd < 0)
+        dieWithError("[ERROR] eventfd error");
     
-    fd_set master_fds;
-    int max_fd;
+    /* Each reactor's metrics get their own cache lines. */
+    Reactor *reactors = aligned_alloc(64, reactorCount * sizeof(Reactor));
+    pthread_t *threads = calloc(reactorCount, sizeof(pthread_t));
+    if (reactors == NULL || threads == NULL)
+        dieWithError("[ERROR] malloc error");
+    memset(reactors, 0, reactorCount * sizeof(Reactor));
     
-    while (1) {
-        handleRequest(server_sockfd, &master_fds, &max_fd);
-        
-        
-        FD_ZERO(&master_fds);
-        FD_SET(server_sockfd, &master_fds);
-        max_fd = server_sockfd;
+    printf("[STARTING] UDP File Server started on %s:%d (%s backend, batch size %d, %d reactors, %d I/O threads).\n\n", ip, port, backend->name, batch_size, reactorCount, ioThreads);
+    
+    logStart();
+    startReadPool(ioThreads);
+    
+    for (int i = 0; i < reactorCount; i++) {
+        reactors[i].index = i;
+        reactors[i].cpu = reactorCpu(i);
+        reactors[i].backend = backend;
+        reactors[i].addr = server_addr;
+        reactors[i].cacheBudget = (cacheMib << 20) / reactorCount;
+        reactors[i].stopFd = stopFd;
+        initReadCompletions(&reactors[i].completions);
+        if (pthread_create(&threads[i], NULL, runReactor, &reactors[i]) != 0)
+            dieWithError("[ERROR] Failed to create reactor thread");
     }
     
+    MetricsEndpoint endpoint;
+    if (metricsPort > 0) {
+        startMetricsEndpoint(&endpoint, metricsPort, reactors, reactorCount);
+        printf("[INFO] Metrics on http://127.0.0.1:%d/metrics\n", metricsPort);
+    }
+    
+    int sig;
+    while (sigwait(&stopSignals, &sig) == 0 && sig == SIGUSR1)
+        printLatency(reactors, reactorCount);
+    printf("\n[CLOSING] Closing the server.\n");
+    
+    uint64_t one = 1;
+    if (write(stopFd, &one, sizeof(one)) < 0)
+        dieWithError("[ERROR] eventfd write error");
+    for (int i = 0; i < reactorCount; i++)
+        pthread_join(threads[i], NULL);
+    stopReadPool();
+    if (metricsPort > 0)
+        stopMetricsEndpoint(&endpoint);
+    logStop();
+    printLatency(reactors, reactorCount);
+    
+    for (int i = 0; i < reactorCount; i++)
+        close(reactors[i].completions.eventFd);
+    close(stopFd);
+    free(threads);
+    free(reactors);
     return 0;
 }
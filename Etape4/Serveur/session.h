@@ -0,0 +1,149 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/* One record per transfer; the table only stores pointers, so the layout of
+   struct Session belongs to the program that uses it. */
+typedef struct Session Session;
+
+#define SESSION_BUCKET_SLOTS 4
+#define SESSION_TABLE_MIN_SLOTS 64
+
+/* Open-addressing table keyed by ip:port with linear probing. Slots are grouped
+   four by four in 64-byte buckets so a probe usually touches one cache line.
+   A key of 0 marks an empty slot. */
+typedef struct {
+    uint64_t keys[SESSION_BUCKET_SLOTS];
+    Session *sessions[SESSION_BUCKET_SLOTS];
+} __attribute__((aligned(64))) SessionBucket;
+
+typedef struct {
+    SessionBucket *buckets;
+    size_t mask;
+    size_t count;
+} SessionTable;
+
+static inline uint64_t sessionKey(struct sockaddr_in addr) {
+    return (1ULL << 48) | ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+/* Home slot of a key: the first slot of its bucket. */
+static inline size_t sessionHome(const SessionTable *table, uint64_t key) {
+    uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 29;
+    return (size_t)(h & table->mask) & ~(size_t)(SESSION_BUCKET_SLOTS - 1);
+}
+
+static inline uint64_t *sessionSlotKey(SessionTable *table, size_t slot) {
+    return &table->buckets[slot / SESSION_BUCKET_SLOTS].keys[slot % SESSION_BUCKET_SLOTS];
+}
+
+static inline Session **sessionSlotValue(SessionTable *table, size_t slot) {
+    return &table->buckets[slot / SESSION_BUCKET_SLOTS].sessions[slot % SESSION_BUCKET_SLOTS];
+}
+
+static int sessionTableAlloc(SessionTable *table, size_t slots) {
+    size_t bytes = slots / SESSION_BUCKET_SLOTS * sizeof(SessionBucket);
+    table->buckets = aligned_alloc(64, bytes);
+    if (table->buckets == NULL)
+        return -1;
+    memset(table->buckets, 0, bytes);
+    table->mask = slots - 1;
+    table->count = 0;
+    return 0;
+}
+
+static int sessionTableInit(SessionTable *table) {
+    return sessionTableAlloc(table, SESSION_TABLE_MIN_SLOTS);
+}
+
+static void sessionTableDestroy(SessionTable *table) {
+    free(table->buckets);
+    table->buckets = NULL;
+    table->mask = 0;
+    table->count = 0;
+}
+
+static void sessionPlace(SessionTable *table, uint64_t key, Session *session) {
+    size_t slot = sessionHome(table, key);
+    while (*sessionSlotKey(table, slot) != 0)
+        slot = (slot + 1) & table->mask;
+    *sessionSlotKey(table, slot) = key;
+    *sessionSlotValue(table, slot) = session;
+    table->count++;
+}
+
+static int sessionTableGrow(SessionTable *table) {
+    SessionTable old = *table;
+    if (sessionTableAlloc(table, (old.mask + 1) * 2) < 0) {
+        *table = old;
+        return -1;
+    }
+    for (size_t slot = 0; slot <= old.mask; slot++) {
+        uint64_t key = *sessionSlotKey(&old, slot);
+        if (key != 0)
+            sessionPlace(table, key, *sessionSlotValue(&old, slot));
+    }
+    free(old.buckets);
+    return 0;
+}
+
+static Session *sessionLookup(SessionTable *table, struct sockaddr_in addr) {
+    uint64_t key = sessionKey(addr);
+    size_t slot = sessionHome(table, key);
+    uint64_t current;
+
+    while ((current = *sessionSlotKey(table, slot)) != 0) {
+        if (current == key)
+            return *sessionSlotValue(table, slot);
+        slot = (slot + 1) & table->mask;
+    }
+    return NULL;
+}
+
+/* Returns -1 if the table cannot grow; the caller keeps ownership then. */
+static int sessionInsert(SessionTable *table, struct sockaddr_in addr, Session *session) {
+    if ((table->count + 1) * 4 > (table->mask + 1) * 3 && sessionTableGrow(table) < 0)
+        return -1;
+    sessionPlace(table, sessionKey(addr), session);
+    return 0;
+}
+
+/* Backward-shift deletion keeps probe chains intact without tombstones. */
+static Session *sessionRemove(SessionTable *table, struct sockaddr_in addr) {
+    uint64_t key = sessionKey(addr);
+    size_t slot = sessionHome(table, key);
+    uint64_t current;
+
+    while ((current = *sessionSlotKey(table, slot)) != key) {
+        if (current == 0)
+            return NULL;
+        slot = (slot + 1) & table->mask;
+    }
+
+    Session *session = *sessionSlotValue(table, slot);
+    size_t hole = slot;
+    size_t next = slot;
+    while (1) {
+        next = (next + 1) & table->mask;
+        current = *sessionSlotKey(table, next);
+        if (current == 0)
+            break;
+        size_t home = sessionHome(table, current);
+        if (((next - home) & table->mask) >= ((next - hole) & table->mask)) {
+            *sessionSlotKey(table, hole) = current;
+            *sessionSlotValue(table, hole) = *sessionSlotValue(table, next);
+            hole = next;
+        }
+    }
+    *sessionSlotKey(table, hole) = 0;
+    *sessionSlotValue(table, hole) = NULL;
+    table->count--;
+    return session;
+}
+
+#endif